@@ -0,0 +1,240 @@
+/*
+ *     Filename: counter.c
+ *  Description: Source file for the per-rule hit counters
+ *
+ *         Note: Searches bump a 64-bit counter in the shard of their
+ *               thread with a relaxed atomic store, readers sum the shards
+ *               with relaxed atomic loads, so a merge while threads count
+ *               sees each counter either before or after an increment,
+ *               never a torn value. Dumps
+ *               only use open(), write() and close() and no allocation,
+ *               so they are also made from the signal handlers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "counter.h"
+#include "dbg.h"
+
+__thread int counter_shard;
+
+static struct hit_counter *signal_cnt;
+static const char *signal_file;
+
+int counter_init(struct hit_counter *cnt, int rule_num, int shard_num)
+{
+	int s;
+	size_t size;
+
+	if (!cnt || rule_num <= 0 || shard_num <= 0 ||
+		shard_num > COUNTER_SHARD_MAX) {
+		return -EINVAL;
+	}
+
+	memset(cnt, 0, sizeof(*cnt));
+
+	/* Whole cache lines, the next shard never shares the last one */
+	size = (rule_num * sizeof(uint64_t) + COUNTER_ALIGN - 1) &
+		   ~(size_t)(COUNTER_ALIGN - 1);
+
+	for (s = 0; s < shard_num; s++) {
+		if (posix_memalign((void **)&cnt->shards[s], COUNTER_ALIGN, size)) {
+			cnt->shards[s] = NULL;
+			counter_destroy(cnt);
+			return -ENOMEM;
+		}
+
+		memset(cnt->shards[s], 0, size);
+	}
+
+	cnt->shard_num = shard_num;
+	cnt->rule_num = rule_num;
+
+	dbg("Hit counters: %d rules, %d shards, Mem=%zu Bytes",
+		rule_num, shard_num, size * shard_num);
+
+	return 0;
+}
+
+void counter_destroy(struct hit_counter *cnt)
+{
+	int s;
+
+	if (!cnt) {
+		return;
+	}
+
+	if (signal_cnt == cnt) {
+		signal_cnt = NULL;
+	}
+
+	for (s = 0; s < COUNTER_SHARD_MAX; s++) {
+		free(cnt->shards[s]);
+		cnt->shards[s] = NULL;
+	}
+
+	cnt->shard_num = cnt->rule_num = 0;
+
+	return;
+}
+
+/* Make the calling thread count into shard, 0 unless set */
+int counter_shard_set(const struct hit_counter *cnt, int shard)
+{
+	if (!cnt || shard < 0 || shard >= cnt->shard_num) {
+		return -EINVAL;
+	}
+
+	counter_shard = shard;
+
+	return 0;
+}
+
+static inline uint64_t counter_sum(const struct hit_counter *cnt, int pri)
+{
+	int s;
+	uint64_t sum = 0;
+
+	for (s = 0; s < cnt->shard_num; s++) {
+		sum += __atomic_load_n(&cnt->shards[s][pri], __ATOMIC_RELAXED);
+	}
+
+	return sum;
+}
+
+/* sums[pri] gets the hits of rule pri over every shard */
+int counter_merge(const struct hit_counter *cnt, uint64_t *sums)
+{
+	int pri;
+
+	if (!cnt || !cnt->shard_num || !sums) {
+		return -EINVAL;
+	}
+
+	for (pri = 0; pri < cnt->rule_num; pri++) {
+		sums[pri] = counter_sum(cnt, pri);
+	}
+
+	return 0;
+}
+
+/* Decimal digits of value ending at end, returns where they start */
+static char *counter_utoa(char *end, uint64_t value)
+{
+	do {
+		*--end = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	return end;
+}
+
+/* One "pri hits" line per rule hit at least once, async-signal-safe */
+static int counter_write(const struct hit_counter *cnt, int fd)
+{
+	int pri;
+	size_t len = 0;
+	char buf[4096], num[24], *p;
+	uint64_t hits;
+
+	for (pri = 0; pri < cnt->rule_num; pri++) {
+		hits = counter_sum(cnt, pri);
+		if (!hits) {
+			continue;
+		}
+
+		if (len + 2 * sizeof(num) > sizeof(buf)) {
+			if (write(fd, buf, len) != (ssize_t)len) {
+				return -EIO;
+			}
+			len = 0;
+		}
+
+		p = counter_utoa(num + sizeof(num), pri);
+		memcpy(buf + len, p, num + sizeof(num) - p);
+		len += num + sizeof(num) - p;
+		buf[len++] = ' ';
+
+		p = counter_utoa(num + sizeof(num), hits);
+		memcpy(buf + len, p, num + sizeof(num) - p);
+		len += num + sizeof(num) - p;
+		buf[len++] = '\n';
+	}
+
+	if (len && write(fd, buf, len) != (ssize_t)len) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int counter_dump(const struct hit_counter *cnt, const char *s_file)
+{
+	int fd, ret;
+
+	if (!cnt || !cnt->shard_num || !s_file) {
+		return -EINVAL;
+	}
+
+	fd = open(s_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	ret = counter_write(cnt, fd);
+	if (close(fd) && !ret) {
+		ret = -EIO;
+	}
+
+	return ret;
+}
+
+static void counter_signal(int sig)
+{
+	int saved = errno;
+
+	if (signal_cnt) {
+		counter_dump(signal_cnt, signal_file);
+	}
+
+	/* SIGUSR1 only takes a snapshot, the others still terminate */
+	if (sig != SIGUSR1) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+
+	errno = saved;
+
+	return;
+}
+
+/* Dump cnt into s_file on SIGUSR1, and before SIGINT or SIGTERM exit */
+int counter_dump_on_signal(struct hit_counter *cnt, const char *s_file)
+{
+	struct sigaction sa;
+
+	if (!cnt || !cnt->shard_num || !s_file) {
+		return -EINVAL;
+	}
+
+	signal_cnt = cnt;
+	signal_file = s_file;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = counter_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(SIGUSR1, &sa, NULL) || sigaction(SIGINT, &sa, NULL) ||
+		sigaction(SIGTERM, &sa, NULL)) {
+		return -errno;
+	}
+
+	return 0;
+}
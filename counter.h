@@ -0,0 +1,56 @@
+/*
+ *     Filename: counter.h
+ *  Description: Header file for the per-rule hit counters
+ */
+
+#ifndef __COUNTER_H__
+#define __COUNTER_H__
+
+#include <stdint.h>
+
+/* count the matched rule of every packet searched */
+//#define ENABLE_HIT_COUNTER	1
+
+/* threads that may count at once, each with a shard of its own */
+#define COUNTER_SHARD_MAX 64
+#define COUNTER_ALIGN 64
+
+/*
+ * shards[s][pri] is the number of packets thread s matched to rule pri.
+ * Only thread s writes its shard and every shard starts on a cache line
+ * of its own, so counting takes neither locks nor shared cache lines.
+ */
+struct hit_counter {
+	uint64_t	*shards[COUNTER_SHARD_MAX];
+	int			shard_num;
+	int			rule_num;
+};
+
+/* The shard of the calling thread, see counter_shard_set() */
+extern __thread int counter_shard;
+
+static inline void counter_hit(struct hit_counter *cnt, int pri)
+{
+#ifdef ENABLE_HIT_COUNTER
+	if (cnt) {
+		uint64_t *p = &cnt->shards[counter_shard][pri];
+
+		/* the only writer: a relaxed load and store, not a locked add */
+		__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + 1,
+						 __ATOMIC_RELAXED);
+	}
+#else
+	(void)cnt;
+	(void)pri;
+#endif
+}
+
+
+int counter_init(struct hit_counter *cnt, int rule_num, int shard_num);
+void counter_destroy(struct hit_counter *cnt);
+int counter_shard_set(const struct hit_counter *cnt, int shard);
+int counter_merge(const struct hit_counter *cnt, uint64_t *sums);
+int counter_dump(const struct hit_counter *cnt, const char *s_file);
+int counter_dump_on_signal(struct hit_counter *cnt, const char *s_file);
+
+#endif /* __COUNTER_H__ */
@@ -0,0 +1,442 @@
+/*
+ *     Filename: dispatch.c
+ *  Description: Source file for per-NIC and per-protocol classifier dispatch
+ *
+ *         Note: The rule set is split by the NIC dimension, or by proto
+ *               and dport for the prefilter, before rfg grouping. Every
+ *               forest is grouped and built on its own with the default
+ *               rule appended, so each one covers the whole space. The
+ *               rules keep their priorities and the subsets take the
+ *               priority of the default rule as def_rule, so the results
+ *               of all forests compare directly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "dispatch.h"
+#include "rfg.h"
+#include "dbg.h"
+
+static inline int dispatch_is_local(const struct rule *p_rule)
+{
+#ifdef ENABLE_NIC
+	return p_rule->dims[DIM_NIC][1] < DISPATCH_NIC_MAX;
+#else
+	return 0;
+#endif
+}
+
+/* Group and build the rules picked by rule_id plus the default rule */
+static int dispatch_forest(struct hs_result **p_hsret,
+						   const struct rule_set *p_rs, const int *rule_id,
+						   int rule_num, const struct hs_config *cfg)
+{
+	int i, ret;
+	struct rule_set rs;
+	struct partition pa, pa_grp, *p_pa = &pa;
+
+	rs.rules = malloc((rule_num + 1) * sizeof(*rs.rules));
+	if (!rs.rules) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < rule_num; i++) {
+		rs.rules[i] = p_rs->rules[rule_id[i]];
+	}
+
+	rs.rules[rule_num] = p_rs->rules[p_rs->def_rule];
+	rs.rule_num = rule_num + 1;
+	rs.def_rule = rule_num; /* rf_group() takes it as an index */
+
+	pa.subsets = &rs;
+	pa.subset_num = 1;
+	pa.rule_num = rs.rule_num;
+
+	if (pa.rule_num > 2) {
+		ret = rf_group(&pa_grp, &pa);
+		if (ret) {
+			free(rs.rules);
+			return ret;
+		}
+
+		p_pa = &pa_grp;
+	}
+
+	/* Leaves below def_rule + 1 are the priorities of the rules */
+	for (i = 0; i < p_pa->subset_num; i++) {
+		p_pa->subsets[i].def_rule = p_rs->rules[p_rs->def_rule].pri;
+	}
+
+	ret = hs_build_config(p_hsret, p_pa, cfg);
+
+	if (p_pa == &pa_grp) {
+		unload_partition(&pa_grp);
+	}
+
+	free(rs.rules);
+
+	return ret;
+}
+
+static int dispatch_node_num(const struct hs_result *hsret)
+{
+	int j, node_num = 0;
+
+	for (j = 0; hsret && j < hsret->tree_num; j++) {
+		node_num += hsret->trees[j].node_num;
+	}
+
+	return node_num;
+}
+
+int dispatch_build(struct dispatch *disp, const struct rule_set *p_rs,
+				   const struct hs_config *cfg)
+{
+	int i, ret = 0, rule_num, node_num, *rule_id;
+	uint32_t nic;
+
+	if (!disp || !p_rs || !p_rs->rules || p_rs->rule_num <= 1 || !cfg) {
+		return -EINVAL;
+	}
+
+	memset(disp, 0, sizeof(*disp));
+	disp->def_rule = p_rs->rules[p_rs->def_rule].pri;
+	disp->counter = cfg->counter;
+
+	rule_id = malloc(p_rs->rule_num * sizeof(*rule_id));
+	if (!rule_id) {
+		return -ENOMEM;
+	}
+
+#ifdef ENABLE_NIC
+	for (nic = 0; nic < DISPATCH_NIC_MAX; nic++) {
+		for (rule_num = 0, i = 0; i < p_rs->rule_num; i++) {
+			const struct rule *p_rule = &p_rs->rules[i];
+
+			if (i != p_rs->def_rule && dispatch_is_local(p_rule) &&
+				p_rule->dims[DIM_NIC][0] <= nic &&
+				nic <= p_rule->dims[DIM_NIC][1]) {
+				rule_id[rule_num++] = i;
+			}
+		}
+
+		if (!rule_num) {
+			continue;
+		}
+
+		ret = dispatch_forest(&disp->nics[nic], p_rs, rule_id, rule_num, cfg);
+		if (ret) {
+			goto err;
+		}
+
+		disp->nic_num++;
+		dbg("NIC %u: %d rules, %d nodes", nic, rule_num,
+			dispatch_node_num(disp->nics[nic]));
+	}
+#endif
+
+	for (rule_num = 0, i = 0; i < p_rs->rule_num; i++) {
+		if (i != p_rs->def_rule && !dispatch_is_local(&p_rs->rules[i])) {
+			rule_id[rule_num++] = i;
+		}
+	}
+
+	if (rule_num) {
+		ret = dispatch_forest(&disp->shared, p_rs, rule_id, rule_num, cfg);
+		if (ret) {
+			goto err;
+		}
+	}
+
+	for (node_num = dispatch_node_num(disp->shared), nic = 0;
+		 nic < DISPATCH_NIC_MAX; nic++) {
+		node_num += dispatch_node_num(disp->nics[nic]);
+	}
+
+	dbg("Dispatch: %d NIC forests, %d shared rules, %d nodes in total",
+		disp->nic_num, rule_num, node_num);
+
+	free(rule_id);
+
+	return 0;
+
+err:
+	free(rule_id);
+	dispatch_destroy(disp);
+
+	return ret;
+}
+
+static inline int dispatch_search_pkt(const struct dispatch *disp,
+									  const struct packet *p_pkt)
+{
+	int pri = disp->def_rule;
+#ifdef ENABLE_NIC
+	uint32_t nic = p_pkt->dims[DIM_NIC];
+
+	if (nic < DISPATCH_NIC_MAX && disp->nics[nic]) {
+		pri = hs_search_pkt(disp->nics[nic], p_pkt);
+	}
+#endif
+
+	/* The shared forest only has to beat the NIC one */
+	if (disp->shared) {
+		pri = hs_search_pkt_below(disp->shared, p_pkt, pri);
+	}
+
+	return pri;
+}
+
+int dispatch_search(const struct trace *trace, const struct dispatch *disp)
+{
+	int i;
+
+	if (!trace || !trace->pkts || !disp) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < trace->pkt_num; i++) {
+		trace->pkts[i].found = dispatch_search_pkt(disp, &trace->pkts[i]);
+		counter_hit(disp->counter, trace->pkts[i].found);
+	}
+
+	return 0;
+}
+
+void dispatch_destroy(struct dispatch *disp)
+{
+	int nic;
+
+	if (!disp) {
+		return;
+	}
+
+	for (nic = 0; nic < DISPATCH_NIC_MAX; nic++) {
+		hs_destroy(&disp->nics[nic]);
+		disp->nics[nic] = NULL;
+	}
+
+	hs_destroy(&disp->shared);
+	disp->shared = NULL;
+	disp->nic_num = 0;
+
+	return;
+}
+
+/* Bit c is set if the rule may match ports of class c */
+static uint32_t prefilter_port_bits(const struct rule *p_rule,
+									const uint32_t *ports, int port_num)
+{
+	int c, picked = 0;
+	uint32_t bits = 0;
+	uint32_t lo = p_rule->dims[DIM_DPORT][0], hi = p_rule->dims[DIM_DPORT][1];
+
+	for (c = 1; c < port_num; c++) {
+		if (lo <= ports[c] && ports[c] <= hi) {
+			bits |= 1 << c;
+			picked++;
+		}
+	}
+
+	/* Class 0 if some port of the range was not picked */
+	if (hi - lo + 1 > (uint32_t)picked) {
+		bits |= 1;
+	}
+
+	return bits;
+}
+
+int prefilter_build(struct prefilter *pf, const struct rule_set *p_rs,
+					const struct hs_config *cfg)
+{
+	int i, c, ret = 0, port_num, rule_num, node_num, forest;
+	int *cnts = NULL, *rule_id = NULL, *rule_nums = NULL, **rule_ids = NULL;
+	uint32_t proto, port, ports[PREFILTER_PORT_MAX], *port_bits = NULL;
+	const int bucket_num = (UINT8_MAX + 1) * PREFILTER_PORT_MAX;
+	const struct rule *p_rule;
+
+	if (!pf || !p_rs || !p_rs->rules || p_rs->rule_num <= 1 || !cfg) {
+		return -EINVAL;
+	}
+
+	memset(pf, 0, sizeof(*pf));
+	pf->def_rule = p_rs->rules[p_rs->def_rule].pri;
+	pf->counter = cfg->counter;
+
+	pf->port_class = calloc(UINT16_MAX + 1, sizeof(*pf->port_class));
+	pf->forests = calloc(bucket_num, sizeof(*pf->forests));
+	cnts = calloc(UINT16_MAX + 1, sizeof(*cnts));
+	rule_id = malloc(p_rs->rule_num * sizeof(*rule_id));
+	port_bits = malloc(p_rs->rule_num * sizeof(*port_bits));
+	rule_ids = calloc(bucket_num, sizeof(*rule_ids));
+	rule_nums = calloc(bucket_num, sizeof(*rule_nums));
+	if (!pf->port_class || !pf->forests || !cnts || !rule_id ||
+		!port_bits || !rule_ids || !rule_nums) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* The most common dport values of the rules get classes of their own */
+	for (i = 0; i < p_rs->rule_num; i++) {
+		p_rule = &p_rs->rules[i];
+
+		if (p_rule->dims[DIM_DPORT][0] == p_rule->dims[DIM_DPORT][1]) {
+			cnts[p_rule->dims[DIM_DPORT][0]]++;
+		}
+	}
+
+	for (port_num = 1; port_num < PREFILTER_PORT_MAX; port_num++) {
+		for (port = 0, i = 1; i <= UINT16_MAX; i++) {
+			if (cnts[i] > cnts[port]) {
+				port = i;
+			}
+		}
+
+		if (!cnts[port]) {
+			break;
+		}
+
+		ports[port_num] = port;
+		pf->port_class[port] = port_num;
+		cnts[port] = 0;
+	}
+
+	for (i = 0; i < p_rs->rule_num; i++) {
+		port_bits[i] = prefilter_port_bits(&p_rs->rules[i], ports, port_num);
+	}
+
+	/* Buckets with the same rules share one forest */
+	for (proto = 0; proto <= UINT8_MAX; proto++) {
+		for (c = 0; c < port_num; c++) {
+			for (rule_num = 0, i = 0; i < p_rs->rule_num; i++) {
+				p_rule = &p_rs->rules[i];
+
+				if (i != p_rs->def_rule && (port_bits[i] & (1 << c)) &&
+					p_rule->dims[DIM_PROTO][0] <= proto &&
+					proto <= p_rule->dims[DIM_PROTO][1]) {
+					rule_id[rule_num++] = i;
+				}
+			}
+
+			for (forest = 0; forest < pf->forest_num; forest++) {
+				if (rule_nums[forest] == rule_num &&
+					!memcmp(rule_ids[forest], rule_id,
+							rule_num * sizeof(*rule_id))) {
+					break;
+				}
+			}
+
+			if (forest == pf->forest_num) {
+				if (forest > UINT8_MAX) {
+					ret = -E2BIG;
+					goto out;
+				}
+
+				rule_ids[forest] = malloc((rule_num + 1) * sizeof(*rule_id));
+				if (!rule_ids[forest]) {
+					ret = -ENOMEM;
+					goto out;
+				}
+
+				memcpy(rule_ids[forest], rule_id, rule_num * sizeof(*rule_id));
+				rule_nums[forest] = rule_num;
+				pf->forest_num++;
+			}
+
+			pf->forest_of[proto][c] = forest;
+		}
+	}
+
+	for (node_num = 0, forest = 0; forest < pf->forest_num; forest++) {
+		if (!rule_nums[forest]) {
+			continue;
+		}
+
+		ret = dispatch_forest(&pf->forests[forest], p_rs, rule_ids[forest],
+							  rule_nums[forest], cfg);
+		if (ret) {
+			goto out;
+		}
+
+		node_num += dispatch_node_num(pf->forests[forest]);
+	}
+
+	dbg("Prefilter: %d port classes, %d forests, %d nodes in total",
+		port_num, pf->forest_num, node_num);
+
+out:
+	if (rule_ids) {
+		for (forest = 0; forest < pf->forest_num; forest++) {
+			free(rule_ids[forest]);
+		}
+	}
+
+	free(rule_nums);
+	free(rule_ids);
+	free(port_bits);
+	free(rule_id);
+	free(cnts);
+
+	if (ret) {
+		prefilter_destroy(pf);
+	}
+
+	return ret;
+}
+
+static inline int prefilter_search_pkt(const struct prefilter *pf,
+									   const struct packet *p_pkt)
+{
+	uint32_t proto = p_pkt->dims[DIM_PROTO], dport = p_pkt->dims[DIM_DPORT];
+	const struct hs_result *hsret;
+
+	if (proto > UINT8_MAX || dport > UINT16_MAX) {
+		return pf->def_rule;
+	}
+
+	hsret = pf->forests[pf->forest_of[proto][pf->port_class[dport]]];
+
+	return hsret ? hs_search_pkt(hsret, p_pkt) : pf->def_rule;
+}
+
+int prefilter_search(const struct trace *trace, const struct prefilter *pf)
+{
+	int i;
+
+	if (!trace || !trace->pkts || !pf || !pf->forests) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < trace->pkt_num; i++) {
+		trace->pkts[i].found = prefilter_search_pkt(pf, &trace->pkts[i]);
+		counter_hit(pf->counter, trace->pkts[i].found);
+	}
+
+	return 0;
+}
+
+void prefilter_destroy(struct prefilter *pf)
+{
+	int forest;
+
+	if (!pf) {
+		return;
+	}
+
+	if (pf->forests) {
+		for (forest = 0; forest < pf->forest_num; forest++) {
+			hs_destroy(&pf->forests[forest]);
+		}
+	}
+
+	free(pf->forests);
+	free(pf->port_class);
+	pf->forests = NULL;
+	pf->port_class = NULL;
+	pf->forest_num = 0;
+
+	return;
+}
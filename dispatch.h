@@ -0,0 +1,57 @@
+/*
+ *     Filename: dispatch.h
+ *  Description: Header file for per-NIC and per-protocol classifier dispatch
+ */
+
+#ifndef __DISPATCH_H__
+#define __DISPATCH_H__
+
+#include <stdint.h>
+#include "rule_trace.h"
+#include "hypersplit.h"
+
+/* NIC values below this get a forest of their own */
+#define DISPATCH_NIC_MAX 64
+
+/*
+ * Rules restricted to NIC values below DISPATCH_NIC_MAX are built into the
+ * forests of those NICs, the others into the shared forest. A packet
+ * searches the forest of its NIC, then the shared one from that result.
+ */
+struct dispatch {
+	struct hs_result	*shared; /* NULL if only the default rule is left */
+	struct hs_result	*nics[DISPATCH_NIC_MAX]; /* NULL: shared forest only */
+	int					nic_num;
+	int					def_rule;
+	struct hit_counter	*counter; /* hs_config.counter of the build */
+};
+
+/* Port classes of the prefilter, class 0 holds the ports not picked */
+#define PREFILTER_PORT_MAX 8
+
+/*
+ * The prefilter picks a forest by proto and the class of dport. Every
+ * forest is built from the rules compatible with its buckets, buckets
+ * with the same rules share a forest.
+ */
+struct prefilter {
+	uint8_t				forest_of[UINT8_MAX + 1][PREFILTER_PORT_MAX];
+	uint8_t				*port_class; /* UINT16_MAX + 1 entries */
+	struct hs_result	**forests; /* NULL if only the default rule is left */
+	int					forest_num;
+	int					def_rule;
+	struct hit_counter	*counter; /* hs_config.counter of the build */
+};
+
+
+int dispatch_build(struct dispatch *disp, const struct rule_set *p_rs,
+				   const struct hs_config *cfg);
+int dispatch_search(const struct trace *trace, const struct dispatch *disp);
+void dispatch_destroy(struct dispatch *disp);
+
+int prefilter_build(struct prefilter *pf, const struct rule_set *p_rs,
+					const struct hs_config *cfg);
+int prefilter_search(const struct trace *trace, const struct prefilter *pf);
+void prefilter_destroy(struct prefilter *pf);
+
+#endif /* __DISPATCH_H__ */
@@ -0,0 +1,241 @@
+/*
+ *     Filename: flow_cache.c
+ *  Description: Source file for the exact-match flow cache
+ *
+ *         Note: A set associative cache keyed by all packet dims. A hash
+ *               of the dims picks the set and gives a 32-bit tag; the
+ *               FC_WAYS tags of a set are compared at once with SSE2 and
+ *               only the candidate ways compare the full key. Sets carry
+ *               the generation they were filled in, so invalidating the
+ *               whole cache is one increment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "hypersplit.h"
+#include "flow_cache.h"
+#include "dbg.h"
+
+static inline uint64_t fc_hash(const struct packet *p_pkt)
+{
+	int d;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (d = 0; d < DIM_MAX; d++) {
+		h = (h ^ p_pkt->dims[d]) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	return h ^ (h >> 29);
+}
+
+/* Ways whose tag equals tag, one bit per way */
+static inline int fc_tag_match(const struct fc_set *p_set, uint32_t tag)
+{
+#if defined(__SSE2__)
+	const __m128i key = _mm_set1_epi32(tag);
+	const __m128i *tags = (const __m128i *)p_set->tags;
+
+	return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(
+				_mm_loadu_si128(tags), key))) |
+		   _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(
+				_mm_loadu_si128(tags + 1), key))) << 4;
+#else
+	int i, mask = 0;
+
+	for (i = 0; i < FC_WAYS; i++) {
+		mask |= (p_set->tags[i] == tag) << i;
+	}
+
+	return mask;
+#endif
+}
+
+static inline struct fc_set *fc_set_get(struct flow_cache *fc, uint64_t h)
+{
+	struct fc_set *p_set = &fc->sets[h & fc->set_mask];
+
+	/* Lazily empty a set left from before the last invalidation */
+	if (p_set->gen != fc->gen) {
+		memset(p_set->tags, 0, sizeof(p_set->tags));
+		p_set->gen = fc->gen;
+		p_set->next = 0;
+	}
+
+	return p_set;
+}
+
+static inline uint32_t fc_tag(uint64_t h)
+{
+	return (h >> 32) | 1;
+}
+
+int fc_init(struct flow_cache *fc, int set_bits, int policy)
+{
+	size_t size;
+
+	if (!fc || set_bits < 0 || set_bits > FC_SET_BITS_MAX ||
+		policy <= FC_POLICY_INV || policy >= FC_POLICY_MAX) {
+		return -EINVAL;
+	}
+
+	size = sizeof(*fc->sets) << set_bits;
+	if (posix_memalign((void **)&fc->sets, HS_CACHE_LINE, size)) {
+		fc->sets = NULL;
+		return -ENOMEM;
+	}
+
+	memset(fc->sets, 0, size);
+	fc->set_mask = (1 << set_bits) - 1;
+	fc->policy = policy;
+	fc->gen = 1;
+	fc->build_gen = 0;
+	fc->clock = 0;
+	fc->seed = 0x2545f491;
+	fc->hits = fc->misses = 0;
+
+	dbg("Flow cache: %u sets of %d ways, Mem=%zu Bytes",
+		fc->set_mask + 1, FC_WAYS, size);
+
+	return 0;
+}
+
+void fc_destroy(struct flow_cache *fc)
+{
+	if (!fc) {
+		return;
+	}
+
+	free(fc->sets);
+	fc->sets = NULL;
+
+	return;
+}
+
+void fc_invalidate(struct flow_cache *fc)
+{
+	if (!fc || !fc->sets) {
+		return;
+	}
+
+	/* Wrapping to 0 would revive sets never touched since fc_init() */
+	if (++fc->gen == 0) {
+		memset(fc->sets, 0, sizeof(*fc->sets) * (fc->set_mask + 1));
+		fc->gen = 1;
+	}
+
+	return;
+}
+
+/* Return the cached priority, or -1 on a miss */
+int fc_lookup(struct flow_cache *fc, const struct packet *p_pkt)
+{
+	int way, mask;
+	uint64_t h = fc_hash(p_pkt);
+	struct fc_set *p_set = fc_set_get(fc, h);
+
+	for (mask = fc_tag_match(p_set, fc_tag(h)); mask; mask &= mask - 1) {
+		way = __builtin_ctz(mask);
+
+		if (!memcmp(p_set->ents[way].dims, p_pkt->dims,
+					sizeof(p_pkt->dims))) {
+			p_set->stamps[way] = ++fc->clock;
+			fc->hits++;
+			return p_set->ents[way].found;
+		}
+	}
+
+	fc->misses++;
+
+	return -1;
+}
+
+void fc_insert(struct flow_cache *fc, const struct packet *p_pkt, int found)
+{
+	int way, i, mask;
+	uint64_t h = fc_hash(p_pkt);
+	struct fc_set *p_set = fc_set_get(fc, h);
+
+	/* A free way first */
+	mask = fc_tag_match(p_set, 0);
+	if (mask) {
+		way = __builtin_ctz(mask);
+	}
+	else {
+		switch (fc->policy) {
+		case FC_POLICY_FIFO:
+			way = p_set->next;
+			p_set->next = (way + 1) % FC_WAYS;
+			break;
+
+		case FC_POLICY_RANDOM:
+			fc->seed ^= fc->seed << 13;
+			fc->seed ^= fc->seed >> 17;
+			fc->seed ^= fc->seed << 5;
+			way = fc->seed % FC_WAYS;
+			break;
+
+		case FC_POLICY_LRU:
+		default:
+			for (way = 0, i = 1; i < FC_WAYS; i++) {
+				if ((int32_t)(p_set->stamps[i] - p_set->stamps[way]) < 0) {
+					way = i;
+				}
+			}
+			break;
+		}
+	}
+
+	p_set->tags[way] = fc_tag(h);
+	p_set->stamps[way] = ++fc->clock;
+	memcpy(p_set->ents[way].dims, p_pkt->dims, sizeof(p_pkt->dims));
+	p_set->ents[way].found = found;
+
+	return;
+}
+
+/*
+ * hs_search() behind the cache: misses walk the trees and fill the cache.
+ * The hits are not counted, the trace was already counted by its search.
+ */
+int fc_search(const struct trace *trace, struct flow_cache *fc,
+			  const void *built_result)
+{
+	int i, found;
+	const struct hs_result *hsret;
+	struct packet *p_pkt;
+
+	if (!trace || !trace->pkts || !fc || !fc->sets || !built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	/* Entries of an older classifier are stale */
+	if (fc->build_gen != hsret->gen) {
+		fc_invalidate(fc);
+		fc->build_gen = hsret->gen;
+	}
+
+	for (i = 0; i < trace->pkt_num; i++) {
+		p_pkt = &trace->pkts[i];
+
+		found = fc_lookup(fc, p_pkt);
+		if (found < 0) {
+			found = hs_search_pkt(hsret, p_pkt);
+			fc_insert(fc, p_pkt, found);
+		}
+
+		p_pkt->found = found;
+	}
+
+	return 0;
+}
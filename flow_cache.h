@@ -0,0 +1,63 @@
+/*
+ *     Filename: flow_cache.h
+ *  Description: Header file for the exact-match flow cache
+ */
+
+#ifndef __FLOW_CACHE_H__
+#define __FLOW_CACHE_H__
+
+#include <stdint.h>
+#include "rule_trace.h"
+
+#define FC_WAYS 8
+/* fc_init() takes up to 2^FC_SET_BITS_MAX sets */
+#define FC_SET_BITS_MAX 24
+
+enum {
+	FC_POLICY_INV		= -1,
+	FC_POLICY_LRU		= 0,
+	FC_POLICY_FIFO		= 1,
+	FC_POLICY_RANDOM	= 2,
+	FC_POLICY_MAX		= 3
+};
+
+struct fc_entry {
+	uint32_t	dims[DIM_MAX];
+	int			found;
+};
+
+/* tags[] of 0 are free, a set of an older generation is all free */
+struct fc_set {
+	uint32_t		tags[FC_WAYS];
+	uint32_t		stamps[FC_WAYS]; /* last use, for FC_POLICY_LRU */
+	uint32_t		gen;
+	uint32_t		next; /* victim way, for FC_POLICY_FIFO */
+	struct fc_entry ents[FC_WAYS];
+};
+
+/*
+ * One instance per thread: lookups update the replacement state, so an
+ * instance must not be shared.
+ */
+struct flow_cache {
+	struct fc_set	*sets;
+	uint32_t		set_mask;
+	int				policy;
+	uint32_t		gen;
+	uint32_t		build_gen; /* hs_result generation the entries belong to */
+	uint32_t		clock;
+	uint32_t		seed;
+	uint64_t		hits;
+	uint64_t		misses;
+};
+
+
+int fc_init(struct flow_cache *fc, int set_bits, int policy);
+void fc_destroy(struct flow_cache *fc);
+void fc_invalidate(struct flow_cache *fc);
+int fc_lookup(struct flow_cache *fc, const struct packet *p_pkt);
+void fc_insert(struct flow_cache *fc, const struct packet *p_pkt, int found);
+int fc_search(const struct trace *trace, struct flow_cache *fc,
+			  const void *built_result);
+
+#endif /* __FLOW_CACHE_H__ */
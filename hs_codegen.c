@@ -0,0 +1,288 @@
+/*
+ *     Filename: hs_codegen.c
+ *  Description: Source file for ahead-of-time code generation of HyperSplit
+ *
+ *         Note: Every tree is emitted as compare-and-branch C code
+ *               with the thresholds as immediates; shallow subtrees become
+ *               conditional expressions the compiler turns into cmov. A
+ *               dispatch function keeps the running minimum across trees.
+ *               The output is compiled into a shared object and loaded
+ *               with dlopen() as an alternative search backend.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <dlfcn.h>
+
+#include "hypersplit.h"
+#include "hs_codegen.h"
+#include "dbg.h"
+
+static int hs_cg_is_shallow(const struct hs_node *nodes, uint32_t id,
+							uint32_t offset, int height)
+{
+	const struct hs_node *p_node;
+
+	if (id < offset) {
+		return 1;
+	}
+
+	if (height == 0) {
+		return 0;
+	}
+
+	p_node = &nodes[id - offset];
+
+	return hs_cg_is_shallow(nodes, p_node->lchild, offset, height - 1) &&
+		   hs_cg_is_shallow(nodes, p_node->rchild, offset, height - 1);
+}
+
+static void hs_cg_expr(FILE *fp, const struct hs_node *nodes, uint32_t id,
+					   uint32_t offset)
+{
+	const struct hs_node *p_node;
+
+	if (id < offset) {
+		fprintf(fp, "%u", id);
+		return;
+	}
+
+	p_node = &nodes[id - offset];
+	fprintf(fp, "(d[%u] <= %" PRIu64 "u ? ", p_node->dim, p_node->threshold);
+	hs_cg_expr(fp, nodes, p_node->lchild, offset);
+	fprintf(fp, " : ");
+	hs_cg_expr(fp, nodes, p_node->rchild, offset);
+	fprintf(fp, ")");
+
+	return;
+}
+
+/*
+ * The left child falls through, the right child is a label to jump to.
+ * Subtrees at HS_CG_FUNC_DEPTH become functions of their own, tail called
+ * and queued in subs, so no single function grows too large to compile.
+ */
+static void hs_cg_stmt(FILE *fp, const struct hs_node *nodes, uint32_t id,
+					   uint32_t offset, int tree, int depth,
+					   uint32_t *subs, int *sub_num)
+{
+	const struct hs_node *p_node;
+
+	if (hs_cg_is_shallow(nodes, id, offset, HS_CG_CMOV_HEIGHT)) {
+		fprintf(fp, "\treturn ");
+		hs_cg_expr(fp, nodes, id, offset);
+		fprintf(fp, ";\n");
+		return;
+	}
+
+	if (depth == HS_CG_FUNC_DEPTH) {
+		fprintf(fp, "\treturn hs_cg_%d_%u(d);\n", tree, id - offset);
+		subs[(*sub_num)++] = id;
+		return;
+	}
+
+	p_node = &nodes[id - offset];
+	if (p_node->rchild < offset) {
+		fprintf(fp, "\tif (d[%u] > %" PRIu64 "u) {\n\t\treturn %u;\n\t}\n",
+				p_node->dim, p_node->threshold, p_node->rchild);
+		hs_cg_stmt(fp, nodes, p_node->lchild, offset, tree, depth + 1,
+				   subs, sub_num);
+		return;
+	}
+
+	fprintf(fp, "\tif (d[%u] > %" PRIu64 "u) {\n\t\tgoto n%u;\n\t}\n",
+			p_node->dim, p_node->threshold, p_node->rchild - offset);
+	hs_cg_stmt(fp, nodes, p_node->lchild, offset, tree, depth + 1,
+			   subs, sub_num);
+	fprintf(fp, "n%u:\n", p_node->rchild - offset);
+	hs_cg_stmt(fp, nodes, p_node->rchild, offset, tree, depth + 1,
+			   subs, sub_num);
+
+	return;
+}
+
+/* Callee first: the body goes to memory, its subtree functions out before */
+static int hs_cg_func(FILE *fp, const struct hs_node *nodes, uint32_t id,
+					  uint32_t offset, int tree)
+{
+	int i, ret = 0, sub_num = 0;
+	char *body = NULL;
+	size_t body_len;
+	uint32_t *subs;
+	FILE *fp_body;
+
+	subs = malloc(sizeof(*subs) << HS_CG_FUNC_DEPTH);
+	if (!subs) {
+		return -ENOMEM;
+	}
+
+	fp_body = open_memstream(&body, &body_len);
+	if (!fp_body) {
+		free(subs);
+		return -ENOMEM;
+	}
+
+	hs_cg_stmt(fp_body, nodes, id, offset, tree, 0, subs, &sub_num);
+	if (fclose(fp_body)) {
+		free(body);
+		free(subs);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < sub_num && !ret; i++) {
+		ret = hs_cg_func(fp, nodes, subs[i], offset, tree);
+	}
+
+	if (!ret) {
+		fprintf(fp, "static int hs_cg_%d_%u(const uint32_t *d)\n{\n%s}\n\n",
+				tree, id - offset, body);
+	}
+
+	free(body);
+	free(subs);
+
+	return ret;
+}
+
+int hs_codegen(const void *built_result, const char *s_cf)
+{
+	int j, ret;
+	FILE *fp;
+	uint32_t offset;
+	const struct hs_result *hsret;
+
+	if (!built_result || !s_cf) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	dbg("Generating code to %s", s_cf);
+
+	fp = fopen(s_cf, "w");
+	if (!fp) {
+		dbg("Cannot open file %s", s_cf);
+		return -errno;
+	}
+
+	offset = hsret->def_rule + 1;
+
+	fprintf(fp, "/* Generated by hs_codegen(): %d trees */\n\n"
+			"#include <stdint.h>\n\n", hsret->tree_num);
+
+	/* One function per tree root, hs_cg_<tree>_0, and per deep subtree */
+	for (j = 0; j < hsret->tree_num; j++) {
+		ret = hs_cg_func(fp, hsret->trees[j].root_node, offset, offset, j);
+		if (ret) {
+			fclose(fp);
+			return ret;
+		}
+	}
+
+	/* Dispatch: running minimum, trees sorted by pri_min */
+	fprintf(fp, "static inline int hs_cg_classify(const uint32_t *d)\n"
+			"{\n"
+			"\tint id, pri = %d;\n\n", hsret->def_rule);
+
+	for (j = 0; j < hsret->tree_num; j++) {
+		fprintf(fp, "\tif (pri < %d) {\n\t\treturn pri;\n\t}\n"
+				"\tid = hs_cg_%d_0(d);\n"
+				"\tpri = id < pri ? id : pri;\n\n",
+				hsret->trees[j].pri_min, j);
+	}
+
+	fprintf(fp, "\treturn pri;\n}\n\n");
+
+	fprintf(fp, "void " HS_CG_SEARCH_SYM "(uint32_t *pkts, int pkt_num, "
+			"int pkt_words, int found_word)\n"
+			"{\n"
+			"\tint i;\n\n"
+			"\tfor (i = 0; i < pkt_num; i++, pkts += pkt_words) {\n"
+			"\t\tpkts[found_word] = hs_cg_classify(pkts);\n"
+			"\t}\n"
+			"}\n");
+
+	if (fclose(fp)) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+int hs_codegen_compile(const char *s_cf, const char *s_so)
+{
+	int ret;
+	char cmd[1024];
+	const char *cc = getenv("CC");
+
+	if (!s_cf || !s_so) {
+		return -EINVAL;
+	}
+
+	snprintf(cmd, sizeof(cmd), "%s -O2 -shared -fPIC -o '%s' '%s'",
+			 cc ? cc : "cc", s_so, s_cf);
+	dbg("Compiling: %s", cmd);
+
+	ret = system(cmd);
+	if (ret) {
+		dbg("Cannot compile %s: status %d", s_cf, ret);
+		return -ENOEXEC;
+	}
+
+	return 0;
+}
+
+int hs_codegen_load(struct hs_codegen *cg, const char *s_so)
+{
+	if (!cg || !s_so) {
+		return -EINVAL;
+	}
+
+	cg->handle = dlopen(s_so, RTLD_NOW | RTLD_LOCAL);
+	if (!cg->handle) {
+		dbg("Cannot load %s: %s", s_so, dlerror());
+		return -ENOENT;
+	}
+
+	cg->search = (hs_cg_search_t)dlsym(cg->handle, HS_CG_SEARCH_SYM);
+	if (!cg->search) {
+		dbg("No symbol " HS_CG_SEARCH_SYM " in %s", s_so);
+		dlclose(cg->handle);
+		cg->handle = NULL;
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+int hs_codegen_search(const struct trace *trace, const struct hs_codegen *cg)
+{
+	if (!trace || !trace->pkts || !cg || !cg->search) {
+		return -EINVAL;
+	}
+
+	cg->search((uint32_t *)trace->pkts, trace->pkt_num,
+			   sizeof(struct packet) / sizeof(uint32_t),
+			   offsetof(struct packet, found) / sizeof(uint32_t));
+
+	return 0;
+}
+
+void hs_codegen_unload(struct hs_codegen *cg)
+{
+	if (!cg || !cg->handle) {
+		return;
+	}
+
+	dlclose(cg->handle);
+	cg->handle = NULL;
+	cg->search = NULL;
+
+	return;
+}
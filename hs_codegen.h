@@ -0,0 +1,34 @@
+/*
+ *     Filename: hs_codegen.h
+ *  Description: Header file for ahead-of-time code generation of HyperSplit
+ */
+
+#ifndef __HS_CODEGEN_H__
+#define __HS_CODEGEN_H__
+
+#include <stdint.h>
+#include "rule_trace.h"
+
+/* subtrees up to this height are emitted as conditional expressions */
+#define HS_CG_CMOV_HEIGHT 2
+/* subtrees this deep are split off into functions of their own */
+#define HS_CG_FUNC_DEPTH 8
+
+#define HS_CG_SEARCH_SYM "hs_cg_search"
+
+typedef void (*hs_cg_search_t)(uint32_t *pkts, int pkt_num, int pkt_words,
+							   int found_word);
+
+struct hs_codegen {
+	void			*handle;
+	hs_cg_search_t	search;
+};
+
+
+int hs_codegen(const void *built_result, const char *s_cf);
+int hs_codegen_compile(const char *s_cf, const char *s_so);
+int hs_codegen_load(struct hs_codegen *cg, const char *s_so);
+int hs_codegen_search(const struct trace *trace, const struct hs_codegen *cg);
+void hs_codegen_unload(struct hs_codegen *cg);
+
+#endif /* __HS_CODEGEN_H__ */
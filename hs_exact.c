@@ -0,0 +1,235 @@
+/*
+ *     Filename: hs_exact.c
+ *  Description: Source file for the exact-match fast path of HyperSplit
+ *
+ *         Note: Rules made of single points and whole domain wildcards
+ *               are moved out of the subsets before the trees are built.
+ *               Each of the most common wildcard patterns gets a hash
+ *               table keyed by the point dimensions. hs_search_pkt() probes
+ *               the tables first and walks the trees from the best hit, so
+ *               the result is the same as with every rule in the trees and
+ *               the trees are skipped as before. Every subset keeps at
+ *               least 2 rules, as hs_trigger() requires.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "hypersplit.h"
+#include "hs_exact.h"
+#include "utils.h"
+#include "dbg.h"
+
+static const uint32_t hs_exact_dim_max[DIM_MAX] = {
+	UINT32_MAX, UINT32_MAX,
+	UINT16_MAX, UINT16_MAX,
+	UINT8_MAX,
+#ifdef ENABLE_NIC
+	UINT32_MAX
+#endif
+};
+
+/* Bitmask of the wildcarded dimensions, -1 if the rule has other ranges */
+static int hs_exact_wild(const struct rule *p_rule)
+{
+	int dim, wild = 0;
+
+	for (dim = 0; dim < DIM_MAX; dim++) {
+		if (p_rule->dims[dim][0] == p_rule->dims[dim][1]) {
+			continue;
+		}
+
+		if (p_rule->dims[dim][0] != 0 ||
+			p_rule->dims[dim][1] != hs_exact_dim_max[dim]) {
+			return -1;
+		}
+
+		wild |= 1 << dim;
+	}
+
+	/* Fully wildcarded rules, i.e. the default rule, stay in the trees */
+	return wild == HS_EXACT_DIM_BITS ? -1 : wild;
+}
+
+static int hs_exact_table_init(struct hs_exact_table *p_tab, int wild,
+							   int rule_num)
+{
+	int dim;
+	uint32_t i;
+	size_t size;
+
+	memset(p_tab, 0, sizeof(*p_tab));
+
+	/* Keep the load factor at or below 1/2 */
+	p_tab->slot_mask = p2roundup(rule_num << 1) - 1;
+	size = (p_tab->slot_mask + 1) * sizeof(*p_tab->slots);
+	if (posix_memalign((void **)&p_tab->slots, HS_CACHE_LINE, size)) {
+		p_tab->slots = NULL;
+		return -ENOMEM;
+	}
+
+	memset(p_tab->slots, 0, size);
+	for (i = 0; i <= p_tab->slot_mask; i++) {
+		p_tab->slots[i].pri = -1;
+	}
+
+	for (dim = 0; dim < DIM_MAX; dim++) {
+		p_tab->mask[dim] = wild & (1 << dim) ? 0 : UINT32_MAX;
+	}
+
+	p_tab->wild = wild;
+	p_tab->pri_min = INT_MAX;
+
+	return 0;
+}
+
+static void hs_exact_insert(struct hs_exact_table *p_tab,
+							const struct rule *p_rule)
+{
+	int d;
+	uint32_t i, key[DIM_MAX];
+	struct hs_exact_slot *p_slot;
+
+	for (d = 0; d < DIM_MAX; d++) {
+		key[d] = p_rule->dims[d][0] & p_tab->mask[d];
+	}
+
+	for (i = hs_exact_hash(key) & p_tab->slot_mask; ;
+		 i = (i + 1) & p_tab->slot_mask) {
+		p_slot = &p_tab->slots[i];
+
+		if (p_slot->pri < 0) {
+			memcpy(p_slot->dims, key, sizeof(key));
+			p_slot->pri = p_rule->pri;
+			p_tab->rule_num++;
+			break;
+		}
+
+		/* The same rule again, only the higher priority one can match */
+		if (!memcmp(p_slot->dims, key, sizeof(key))) {
+			if (p_rule->pri < p_slot->pri) {
+				p_slot->pri = p_rule->pri;
+			}
+			break;
+		}
+	}
+
+	if (p_rule->pri < p_tab->pri_min) {
+		p_tab->pri_min = p_rule->pri;
+	}
+
+	return;
+}
+
+static int hs_exact_table_cmp(const void *left, const void *right)
+{
+	const struct hs_exact_table *l = left, *r = right;
+
+	return l->pri_min < r->pri_min ? -1 : l->pri_min > r->pri_min;
+}
+
+int hs_exact_split(struct hs_exact *exact, struct partition *part)
+{
+	int i, j, k, t, wild, ret, rule_num = 0;
+	int cnts[1 << DIM_MAX] = { 0 }, table_of[1 << DIM_MAX];
+	struct rule_set *p_rs;
+
+	if (!exact || !part || !part->subsets) {
+		return -EINVAL;
+	}
+
+	memset(exact, 0, sizeof(*exact));
+
+	for (i = 0; i < part->subset_num; i++) {
+		p_rs = &part->subsets[i];
+
+		for (j = 0; j < p_rs->rule_num; j++) {
+			wild = hs_exact_wild(&p_rs->rules[j]);
+			if (wild >= 0) {
+				cnts[wild]++;
+			}
+		}
+	}
+
+	/* Pick the most common patterns */
+	for (i = 0; i < 1 << DIM_MAX; i++) {
+		table_of[i] = -1;
+	}
+
+	for (t = 0; t < HS_EXACT_TABLE_MAX; t++) {
+		for (wild = -1, i = 0; i < 1 << DIM_MAX; i++) {
+			if (table_of[i] < 0 && cnts[i] >= HS_EXACT_RULE_MIN &&
+				(wild < 0 || cnts[i] > cnts[wild])) {
+				wild = i;
+			}
+		}
+
+		if (wild < 0) {
+			break;
+		}
+
+		ret = hs_exact_table_init(&exact->tables[t], wild, cnts[wild]);
+		if (ret) {
+			hs_exact_destroy(exact);
+			return ret;
+		}
+
+		table_of[wild] = t;
+		exact->table_num++;
+	}
+
+	/* Move the rules out, the order of the rules left is kept */
+	for (i = 0; i < part->subset_num; i++) {
+		p_rs = &part->subsets[i];
+
+		for (j = k = 0; j < p_rs->rule_num; j++) {
+			wild = hs_exact_wild(&p_rs->rules[j]);
+			if (wild >= 0 && table_of[wild] >= 0 &&
+				p_rs->rule_num - (j - k) > 2) {
+				hs_exact_insert(&exact->tables[table_of[wild]],
+								&p_rs->rules[j]);
+				continue;
+			}
+
+			p_rs->rules[k++] = p_rs->rules[j];
+		}
+
+		p_rs->rule_num = k;
+	}
+
+	for (t = 0; t < exact->table_num; t++) {
+		dbg("Exact match: wild 0x%02x, %d rules, Mem=%zu Bytes",
+			exact->tables[t].wild, exact->tables[t].rule_num,
+			(exact->tables[t].slot_mask + 1) * sizeof(struct hs_exact_slot));
+		rule_num += exact->tables[t].rule_num;
+	}
+
+	dbg("Exact match: %d rules in %d tables", rule_num, exact->table_num);
+
+	/* Searches stop at the first table that cannot beat the result */
+	qsort(exact->tables, exact->table_num, sizeof(*exact->tables),
+		  hs_exact_table_cmp);
+
+	return 0;
+}
+
+void hs_exact_destroy(struct hs_exact *exact)
+{
+	int t;
+
+	if (!exact) {
+		return;
+	}
+
+	for (t = 0; t < exact->table_num; t++) {
+		free(exact->tables[t].slots);
+		exact->tables[t].slots = NULL;
+	}
+
+	exact->table_num = 0;
+
+	return;
+}
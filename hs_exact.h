@@ -0,0 +1,134 @@
+/*
+ *     Filename: hs_exact.h
+ *  Description: Header file for the exact-match fast path of HyperSplit
+ */
+
+#ifndef __HS_EXACT_H__
+#define __HS_EXACT_H__
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "rule_trace.h"
+
+/* one table per wildcard pattern, the most common patterns first */
+#define HS_EXACT_TABLE_MAX 4
+/* smaller patterns are left to the trees */
+#define HS_EXACT_RULE_MIN 64
+
+#define HS_EXACT_DIM_BITS ((1 << DIM_MAX) - 1)
+
+/* 32 bytes, compared in two 16-byte halves */
+struct hs_exact_slot {
+	uint32_t	dims[DIM_MAX];
+	int			pri; /* -1 if the slot is free */
+} __attribute__((aligned(32)));
+
+/*
+ * Rules whose every dimension is a single point or the whole domain, with
+ * the wildcarded dimensions in wild. Keys are packet dims with the
+ * wildcarded dimensions masked to 0, in an open addressing hash table.
+ */
+struct hs_exact_table {
+	uint32_t				mask[8] __attribute__((aligned(16)));
+	struct hs_exact_slot	*slots;
+	uint32_t				slot_mask;
+	uint32_t				wild;
+	int						rule_num;
+	int						pri_min;
+};
+
+struct hs_exact {
+	struct hs_exact_table	tables[HS_EXACT_TABLE_MAX]; /* by pri_min */
+	int						table_num;
+};
+
+static inline uint32_t hs_exact_hash(const uint32_t *key)
+{
+	int d;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (d = 0; d < DIM_MAX; d++) {
+		h = (h ^ key[d]) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	/* Fold the high bits in, the products only carry upwards */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+
+	return h ^ (h >> 33);
+}
+
+static inline int hs_exact_match(const struct hs_exact_slot *p_slot,
+								 const uint32_t *key)
+{
+#if defined(__SSE2__)
+	const __m128i *slot = (const __m128i *)p_slot;
+	const __m128i *k = (const __m128i *)key;
+	int mask;
+
+	mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(
+				_mm_load_si128(slot), _mm_load_si128(k)))) |
+		   _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(
+				_mm_load_si128(slot + 1), _mm_load_si128(k + 1)))) << 4;
+
+	return (mask & HS_EXACT_DIM_BITS) == HS_EXACT_DIM_BITS;
+#else
+	return !memcmp(p_slot->dims, key, sizeof(p_slot->dims));
+#endif
+}
+
+/* Return the priority of the matching rule, or -1 */
+static inline int hs_exact_lookup(const struct hs_exact_table *p_tab,
+								  const struct packet *p_pkt)
+{
+	int d;
+	uint32_t i;
+	uint32_t key[8] __attribute__((aligned(16))) = { 0 };
+	const struct hs_exact_slot *p_slot;
+
+	for (d = 0; d < DIM_MAX; d++) {
+		key[d] = p_pkt->dims[d] & p_tab->mask[d];
+	}
+
+	for (i = hs_exact_hash(key) & p_tab->slot_mask; ;
+		 i = (i + 1) & p_tab->slot_mask) {
+		p_slot = &p_tab->slots[i];
+
+		if (p_slot->pri < 0) {
+			return -1;
+		}
+
+		if (hs_exact_match(p_slot, key)) {
+			return p_slot->pri;
+		}
+	}
+}
+
+/* The best of pri and the table hits, tables that cannot beat it skipped */
+static inline int hs_exact_search_pkt(const struct hs_exact *exact,
+									  const struct packet *p_pkt, int pri)
+{
+	int t, found;
+
+	for (t = 0; t < exact->table_num; t++) {
+		if (pri <= exact->tables[t].pri_min) {
+			break;
+		}
+
+		found = hs_exact_lookup(&exact->tables[t], p_pkt);
+		if (found >= 0 && found < pri) {
+			pri = found;
+		}
+	}
+
+	return pri;
+}
+
+
+int hs_exact_split(struct hs_exact *exact, struct partition *part);
+void hs_exact_destroy(struct hs_exact *exact);
+
+#endif /* __HS_EXACT_H__ */
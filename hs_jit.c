@@ -0,0 +1,301 @@
+/*
+ *     Filename: hs_jit.c
+ *  Description: Source file for the runtime x86-64 JIT of HyperSplit
+ *
+ *         Note: The forest is translated into one function,
+ *               int classify(const uint32_t *dims), in an mmap'd buffer.
+ *               Every node is a compare of the packet field against the
+ *               threshold immediate and a jump to the right child, with the
+ *               left child falling through. A leaf loads its priority and
+ *               jumps to the end of the tree, where the running minimum is
+ *               kept. Trees stay in pri_min order with the same early exit
+ *               as hs_search_pkt(), so the results are bit identical.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "hypersplit.h"
+#include "hs_jit.h"
+#include "dbg.h"
+
+#ifdef ENABLE_JIT
+
+/*
+ * Emitted code, running minimum in ecx, leaf priority in eax:
+ *
+ *   entry:  mov ecx, def_rule
+ *   tree:   cmp ecx, pri_min; jl done
+ *   node:   cmp dword [rdi + dim * 4], threshold; ja right
+ *           <left child>
+ *   right:  <right child>
+ *   leaf:   mov eax, pri; jmp tree_end
+ *   tree_end: cmp eax, ecx; cmovb ecx, eax
+ *   done:   mov eax, ecx; ret
+ */
+#define JIT_ENTRY_SIZE 5
+#define JIT_TREE_HEAD_SIZE 12
+#define JIT_TREE_TAIL_SIZE 5
+
+struct hs_jit_buf {
+	uint8_t		*code; /* NULL to only measure */
+	size_t		len;
+};
+
+static inline void jit_byte(struct hs_jit_buf *b, uint8_t byte)
+{
+	if (b->code) {
+		b->code[b->len] = byte;
+	}
+
+	b->len++;
+
+	return;
+}
+
+static inline void jit_imm32(struct hs_jit_buf *b, uint32_t imm)
+{
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		jit_byte(b, imm >> (i * 8));
+	}
+
+	return;
+}
+
+static inline void jit_patch32(struct hs_jit_buf *b, size_t pos, uint32_t imm)
+{
+	if (b->code) {
+		memcpy(b->code + pos, &imm, sizeof(imm));
+	}
+
+	return;
+}
+
+/* Emit the subtree at id, whose leaves jump to tree_end */
+static int hs_jit_node(struct hs_jit_buf *b, const struct hs_node *nodes,
+					   uint32_t id, uint32_t offset, size_t tree_end)
+{
+	int ret;
+	size_t rel;
+	const struct hs_node *p_node;
+
+	if (id < offset) {
+		/* mov eax, imm32; jmp rel32 */
+		jit_byte(b, 0xb8);
+		jit_imm32(b, id);
+		jit_byte(b, 0xe9);
+		jit_imm32(b, tree_end - (b->len + 4));
+		return 0;
+	}
+
+	p_node = &nodes[id - offset];
+	if (p_node->threshold > UINT32_MAX) {
+		return -ERANGE;
+	}
+
+	/* cmp dword [rdi + disp8], imm32 */
+	jit_byte(b, 0x81);
+	jit_byte(b, 0x7f);
+	jit_byte(b, p_node->dim * sizeof(uint32_t));
+	jit_imm32(b, p_node->threshold);
+
+	/* ja rel32, patched once the left child is out */
+	jit_byte(b, 0x0f);
+	jit_byte(b, 0x87);
+	rel = b->len;
+	jit_imm32(b, 0);
+
+	ret = hs_jit_node(b, nodes, p_node->lchild, offset, tree_end);
+	if (ret) {
+		return ret;
+	}
+
+	jit_patch32(b, rel, b->len - (rel + 4));
+
+	return hs_jit_node(b, nodes, p_node->rchild, offset, tree_end);
+}
+
+/* Two passes: measure every tree, then emit with the tree ends known */
+static int hs_jit_emit(struct hs_jit_buf *b, const struct hs_result *hsret,
+					   size_t *tree_size)
+{
+	int j, ret;
+	size_t start, done, tree_end;
+	uint32_t offset = hsret->def_rule + 1;
+
+	done = JIT_ENTRY_SIZE;
+	for (j = 0; j < hsret->tree_num; j++) {
+		done += JIT_TREE_HEAD_SIZE + tree_size[j] + JIT_TREE_TAIL_SIZE;
+	}
+
+	/* mov ecx, imm32 */
+	jit_byte(b, 0xb9);
+	jit_imm32(b, hsret->def_rule);
+
+	for (j = 0; j < hsret->tree_num; j++) {
+		/* cmp ecx, imm32; jl rel32 */
+		jit_byte(b, 0x81);
+		jit_byte(b, 0xf9);
+		jit_imm32(b, hsret->trees[j].pri_min);
+		jit_byte(b, 0x0f);
+		jit_byte(b, 0x8c);
+		jit_imm32(b, done - (b->len + 4));
+
+		start = b->len;
+		tree_end = start + tree_size[j];
+
+		ret = hs_jit_node(b, hsret->trees[j].root_node, offset, offset,
+						  tree_end);
+		if (ret) {
+			return ret;
+		}
+
+		if (!b->code) {
+			tree_size[j] = b->len - start;
+			done += tree_size[j];
+		}
+
+		/* cmp eax, ecx; cmovb ecx, eax */
+		jit_byte(b, 0x39);
+		jit_byte(b, 0xc8);
+		jit_byte(b, 0x0f);
+		jit_byte(b, 0x42);
+		jit_byte(b, 0xc8);
+	}
+
+	/* mov eax, ecx; ret */
+	jit_byte(b, 0x89);
+	jit_byte(b, 0xc8);
+	jit_byte(b, 0xc3);
+
+	return 0;
+}
+
+int hs_jit_compile(struct hs_jit *jit, const void *built_result)
+{
+	int ret;
+	size_t *tree_size;
+	struct hs_jit_buf b;
+	const struct hs_result *hsret;
+
+	if (!jit || !built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	memset(jit, 0, sizeof(*jit));
+	jit->built_result = built_result;
+
+	tree_size = calloc(hsret->tree_num, sizeof(*tree_size));
+	if (!tree_size) {
+		return -ENOMEM;
+	}
+
+	b.code = NULL;
+	b.len = 0;
+
+	ret = hs_jit_emit(&b, hsret, tree_size);
+	if (ret) {
+		goto err;
+	}
+
+	jit->size = b.len;
+	jit->code = mmap(NULL, jit->size, PROT_READ | PROT_WRITE,
+					 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit->code == MAP_FAILED) {
+		jit->code = NULL;
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	b.code = jit->code;
+	b.len = 0;
+
+	ret = hs_jit_emit(&b, hsret, tree_size);
+	if (ret) {
+		goto err;
+	}
+
+	if (mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC)) {
+		ret = -errno;
+		goto err;
+	}
+
+	jit->classify = (hs_jit_classify_t)jit->code;
+
+	dbg("JIT code: %zu Bytes for %d trees", jit->size, hsret->tree_num);
+
+	free(tree_size);
+
+	return 0;
+
+err:
+	dbg("Cannot JIT compile: %d", ret);
+	hs_jit_free(jit);
+	free(tree_size);
+
+	return ret;
+}
+
+#else /* !ENABLE_JIT */
+
+int hs_jit_compile(struct hs_jit *jit, const void *built_result)
+{
+	if (!jit || !built_result) {
+		return -EINVAL;
+	}
+
+	memset(jit, 0, sizeof(*jit));
+	jit->built_result = built_result;
+
+	dbg("JIT disabled, using hs_search()");
+
+	return 0;
+}
+
+#endif /* ENABLE_JIT */
+
+int hs_jit_search(const struct trace *trace, const struct hs_jit *jit)
+{
+	int i;
+
+	if (!trace || !trace->pkts || !jit) {
+		return -EINVAL;
+	}
+
+	if (!jit->classify) {
+		return hs_search(trace, jit->built_result);
+	}
+
+	for (i = 0; i < trace->pkt_num; i++) {
+		trace->pkts[i].found = jit->classify(trace->pkts[i].dims);
+	}
+
+	return 0;
+}
+
+void hs_jit_free(struct hs_jit *jit)
+{
+	if (!jit) {
+		return;
+	}
+
+	if (jit->code) {
+		munmap(jit->code, jit->size);
+	}
+
+	jit->code = NULL;
+	jit->size = 0;
+	jit->classify = NULL;
+
+	return;
+}
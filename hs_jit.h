@@ -0,0 +1,32 @@
+/*
+ *     Filename: hs_jit.h
+ *  Description: Header file for the runtime x86-64 JIT of HyperSplit
+ */
+
+#ifndef __HS_JIT_H__
+#define __HS_JIT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "rule_trace.h"
+
+/* translate trees into machine code, otherwise hs_search() is used */
+#if defined(__x86_64__)
+#define ENABLE_JIT 1
+#endif
+
+typedef int (*hs_jit_classify_t)(const uint32_t *dims);
+
+struct hs_jit {
+	const void			*built_result;
+	void				*code; /* NULL if falling back to hs_search() */
+	size_t				size;
+	hs_jit_classify_t	classify;
+};
+
+
+int hs_jit_compile(struct hs_jit *jit, const void *built_result);
+int hs_jit_search(const struct trace *trace, const struct hs_jit *jit);
+void hs_jit_free(struct hs_jit *jit);
+
+#endif /* __HS_JIT_H__ */
@@ -0,0 +1,249 @@
+/*
+ *     Filename: hs_simd.c
+ *  Description: Source file for gather based SIMD search of HyperSplit
+ *
+ *         Note: Each kernel walks one tree for 8 (AVX2) or 16 (AVX-512)
+ *               packets at once. Node fields and the packet field selected
+ *               by the node dimension are gathered, the children are picked
+ *               by a masked compare and blend, and lanes that reach a leaf
+ *               (id < offset) retire while the others keep walking.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "hypersplit.h"
+#include "dbg.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * struct hs_node viewed as four 32-bit words:
+ *   [0] threshold (low half, all split points fit in 32 bits)
+ *   [1] threshold (high half, always 0)
+ *   [2] dim | lchild << 3
+ *   [3] pack | rchild << 3
+ */
+#define HSN_WORD_NUM (sizeof(struct hs_node) / sizeof(uint32_t))
+#define HSN_DIM_MASK ((1 << (32 - NODE_NUM_BITS)) - 1)
+#define HSN_CHILD_SHIFT (32 - NODE_NUM_BITS)
+#define PKT_WORD_NUM (sizeof(struct packet) / sizeof(uint32_t))
+
+typedef void (*hs_simd_kernel_t)(const struct hs_result *hsret,
+								 struct packet *pkts);
+
+__attribute__((target("avx2")))
+static void hs_kernel_avx2(const struct hs_result *hsret, struct packet *pkts)
+{
+	int j;
+	__m256i id, pri, idx, thr, lword, rword, dim, val, le, active;
+	const __m256i offset = _mm256_set1_epi32(hsret->def_rule + 1);
+	const __m256i last = _mm256_set1_epi32(hsret->def_rule);
+	const __m256i dim_mask = _mm256_set1_epi32(HSN_DIM_MASK);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i pkt_base = _mm256_mullo_epi32(
+		_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+		_mm256_set1_epi32(PKT_WORD_NUM));
+	const int *p_pkt = (const int *)pkts;
+
+	pri = last;
+
+	/* For each tree, until no lane can improve */
+	for (j = 0; j < hsret->tree_num; j++) {
+		const int *p_node = (const int *)hsret->trees[j].root_node;
+
+		active = _mm256_cmpgt_epi32(_mm256_set1_epi32(hsret->trees[j].pri_min),
+									pri);
+		if (_mm256_movemask_epi8(active) == -1) {
+			break;
+		}
+
+		id = offset;
+		active = _mm256_set1_epi32(-1);
+
+		/* For each level, until every lane reaches a leaf */
+		do {
+			idx = _mm256_slli_epi32(_mm256_sub_epi32(id, offset), 2);
+
+			thr = _mm256_mask_i32gather_epi32(zero, p_node, idx, active, 4);
+			lword = _mm256_mask_i32gather_epi32(zero, p_node + 2, idx,
+												active, 4);
+			rword = _mm256_mask_i32gather_epi32(zero, p_node + 3, idx,
+												active, 4);
+
+			dim = _mm256_and_si256(lword, dim_mask);
+			val = _mm256_mask_i32gather_epi32(zero, p_pkt,
+											  _mm256_add_epi32(pkt_base, dim),
+											  active, 4);
+
+			/* unsigned val <= thr */
+			le = _mm256_cmpeq_epi32(_mm256_max_epu32(val, thr), thr);
+			idx = _mm256_blendv_epi8(_mm256_srli_epi32(rword, HSN_CHILD_SHIFT),
+									 _mm256_srli_epi32(lword, HSN_CHILD_SHIFT),
+									 le);
+
+			id = _mm256_blendv_epi8(id, idx, active);
+			active = _mm256_cmpgt_epi32(id, last);
+		} while (!_mm256_testz_si256(active, active));
+
+		pri = _mm256_min_epi32(pri, id);
+	}
+
+	for (j = 0; j < 8; j++) {
+		pkts[j].found = ((const int *)&pri)[j];
+		counter_hit(hsret->counter, pkts[j].found);
+	}
+
+	return;
+}
+
+__attribute__((target("avx512f")))
+static void hs_kernel_avx512(const struct hs_result *hsret, struct packet *pkts)
+{
+	int j;
+	__mmask16 active, le;
+	__m512i id, pri, idx, thr, lword, rword, dim, val;
+	const __m512i offset = _mm512_set1_epi32(hsret->def_rule + 1);
+	const __m512i last = _mm512_set1_epi32(hsret->def_rule);
+	const __m512i dim_mask = _mm512_set1_epi32(HSN_DIM_MASK);
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i pkt_base = _mm512_mullo_epi32(
+		_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+						  8, 9, 10, 11, 12, 13, 14, 15),
+		_mm512_set1_epi32(PKT_WORD_NUM));
+	const int *p_pkt = (const int *)pkts;
+
+	pri = last;
+
+	/* For each tree, until no lane can improve */
+	for (j = 0; j < hsret->tree_num; j++) {
+		const int *p_node = (const int *)hsret->trees[j].root_node;
+
+		if (_mm512_cmplt_epi32_mask(pri, _mm512_set1_epi32(
+										hsret->trees[j].pri_min)) == 0xffff) {
+			break;
+		}
+
+		id = offset;
+		active = 0xffff;
+
+		/* For each level, until every lane reaches a leaf */
+		do {
+			idx = _mm512_slli_epi32(_mm512_sub_epi32(id, offset), 2);
+
+			thr = _mm512_mask_i32gather_epi32(zero, active, idx, p_node, 4);
+			lword = _mm512_mask_i32gather_epi32(zero, active, idx,
+												p_node + 2, 4);
+			rword = _mm512_mask_i32gather_epi32(zero, active, idx,
+												p_node + 3, 4);
+
+			dim = _mm512_and_si512(lword, dim_mask);
+			val = _mm512_mask_i32gather_epi32(zero, active,
+											  _mm512_add_epi32(pkt_base, dim),
+											  p_pkt, 4);
+
+			le = _mm512_cmple_epu32_mask(val, thr);
+			idx = _mm512_mask_blend_epi32(le,
+										  _mm512_srli_epi32(rword, HSN_CHILD_SHIFT),
+										  _mm512_srli_epi32(lword, HSN_CHILD_SHIFT));
+
+			id = _mm512_mask_mov_epi32(id, active, idx);
+			active = _mm512_cmpgt_epi32_mask(id, last);
+		} while (active);
+
+		pri = _mm512_min_epi32(pri, id);
+	}
+
+	for (j = 0; j < 16; j++) {
+		pkts[j].found = ((const int *)&pri)[j];
+		counter_hit(hsret->counter, pkts[j].found);
+	}
+
+	return;
+}
+
+static hs_simd_kernel_t hs_simd_select(int *lane_num)
+{
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) {
+		dbg("Using AVX-512 search kernel");
+		*lane_num = 16;
+		return hs_kernel_avx512;
+	}
+
+	if (__builtin_cpu_supports("avx2")) {
+		dbg("Using AVX2 search kernel");
+		*lane_num = 8;
+		return hs_kernel_avx2;
+	}
+
+	dbg("No SIMD search kernel, using scalar search");
+
+	return NULL;
+}
+
+#else /* !__x86_64__ && !__i386__ */
+
+typedef void (*hs_simd_kernel_t)(const struct hs_result *hsret,
+								 struct packet *pkts);
+
+static hs_simd_kernel_t hs_simd_select(int *lane_num)
+{
+	*lane_num = 1;
+	return NULL;
+}
+
+#endif
+
+/* Picked once for every search thread, see hs_simd_init() */
+static pthread_once_t hs_simd_once = PTHREAD_ONCE_INIT;
+static hs_simd_kernel_t hs_simd_kernel;
+static int hs_simd_lane_num;
+
+static void hs_simd_init(void)
+{
+	hs_simd_kernel = hs_simd_select(&hs_simd_lane_num);
+
+	return;
+}
+
+int hs_search_simd(const struct trace *trace, const void *built_result)
+{
+	int i, lane_num;
+	const struct hs_result *hsret;
+	hs_simd_kernel_t kernel;
+
+	if (!trace || !trace->pkts || !built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	pthread_once(&hs_simd_once, hs_simd_init);
+	kernel = hs_simd_kernel;
+	lane_num = hs_simd_lane_num;
+
+	i = 0;
+
+	if (kernel) {
+		for (; i + lane_num <= trace->pkt_num; i += lane_num) {
+			kernel(hsret, &trace->pkts[i]);
+		}
+	}
+
+	/* The remainder, or everything without SIMD support */
+	for (; i < trace->pkt_num; i++) {
+		trace->pkts[i].found = hs_search_pkt(hsret, &trace->pkts[i]);
+		counter_hit(hsret->counter, trace->pkts[i].found);
+	}
+
+	return 0;
+}
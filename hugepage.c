@@ -0,0 +1,236 @@
+/*
+ *     Filename: hugepage.c
+ *  Description: Source file for huge page backed storage
+ *
+ *         Note: hp_alloc() maps whole 2MB pages, prefaulted so that no
+ *               search takes a page fault. Reserved huge pages are tried
+ *               first. Without them an aligned anonymous mapping asks for
+ *               transparent huge pages, and if the kernel refuses those
+ *               too the mapping stays on base pages, so callers always get
+ *               memory when there is any. hp_alloc_node() binds the pages
+ *               to a NUMA node with a raw mbind(2) before they are faulted
+ *               in. hp_tlb_*() count the dTLB load misses of the calling
+ *               thread and the threads it starts with perf_event_open(2).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/mempolicy.h>
+
+#include "hugepage.h"
+#include "dbg.h"
+
+static inline size_t hp_roundup(size_t size)
+{
+	return (size + HP_SIZE - 1) & ~(HP_SIZE - 1);
+}
+
+/* Fault in every page now instead of on the first search */
+static void hp_prefault(void *ptr, size_t size)
+{
+	size_t i;
+	long page = sysconf(_SC_PAGESIZE);
+
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(ptr, size, MADV_POPULATE_WRITE)) {
+		return;
+	}
+#endif
+
+	for (i = 0; i < size; i += page) {
+		((volatile char *)ptr)[i] = 0;
+	}
+
+	return;
+}
+
+/* Pages not faulted in yet come from node, a failure leaves the default */
+static void hp_bind(void *ptr, size_t size, int node)
+{
+	unsigned long mask[HP_NODE_MAX / (8 * sizeof(unsigned long))] = { 0 };
+
+	if (node < 0 || node >= HP_NODE_MAX) {
+		return;
+	}
+
+	mask[node / (8 * sizeof(*mask))] = 1UL << node % (8 * sizeof(*mask));
+	if (syscall(__NR_mbind, ptr, size, MPOL_BIND, mask, HP_NODE_MAX + 1, 0)) {
+		dbg("Cannot bind to node %d: %s", node, strerror(errno));
+	}
+
+	return;
+}
+
+/*
+ * Return size bytes, rounded up to whole huge pages and aligned to
+ * HP_SIZE, and the kind of pages backing them in p_kind if not NULL.
+ */
+void *hp_alloc(size_t size, int *p_kind)
+{
+	return hp_alloc_node(size, -1, p_kind);
+}
+
+/* As hp_alloc(), on the memory of NUMA node node, or anywhere if < 0 */
+void *hp_alloc_node(size_t size, int node, int *p_kind)
+{
+	int kind;
+	size_t rsize;
+	char *ptr, *aligned;
+
+	if (!size) {
+		return NULL;
+	}
+
+	rsize = hp_roundup(size);
+
+	/* Populated only once bound */
+	ptr = mmap(NULL, rsize, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			   (node < 0 ? MAP_POPULATE : 0), -1, 0);
+	if (ptr != MAP_FAILED) {
+		kind = HP_KIND_HUGETLB;
+		if (node >= 0) {
+			hp_bind(ptr, rsize, node);
+			hp_prefault(ptr, rsize);
+		}
+		goto out;
+	}
+
+	/* Map one more huge page to cut an aligned range out of */
+	ptr = mmap(NULL, rsize + HP_SIZE, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		return NULL;
+	}
+
+	aligned = (char *)(((uintptr_t)ptr + HP_SIZE - 1) & ~(HP_SIZE - 1));
+	if (aligned > ptr) {
+		munmap(ptr, aligned - ptr);
+	}
+	munmap(aligned + rsize, ptr + HP_SIZE - aligned);
+	ptr = aligned;
+
+	kind = madvise(ptr, rsize, MADV_HUGEPAGE) ? HP_KIND_PAGE : HP_KIND_THP;
+	hp_bind(ptr, rsize, node);
+	hp_prefault(ptr, rsize);
+
+out:
+	if (p_kind) {
+		*p_kind = kind;
+	}
+
+	return ptr;
+}
+
+/* size is the one given to hp_alloc() */
+void hp_free(void *ptr, size_t size)
+{
+	if (!ptr) {
+		return;
+	}
+
+	munmap(ptr, hp_roundup(size));
+
+	return;
+}
+
+const char *hp_kind_name(int kind)
+{
+	static const char *s_names[HP_KIND_MAX] = {
+		[HP_KIND_HUGETLB]	= "hugetlb",
+		[HP_KIND_THP]		= "transparent huge pages",
+		[HP_KIND_PAGE]		= "base pages"
+	};
+
+	if (kind <= HP_KIND_INV || kind >= HP_KIND_MAX) {
+		return "unknown";
+	}
+
+	return s_names[kind];
+}
+
+static void *hp_hs_alloc_fn(size_t size, void *arg)
+{
+	int kind;
+	void *ptr = hp_alloc(size, &kind);
+
+	(void)arg;
+
+	if (ptr) {
+		dbg("Huge page storage: %zu Bytes on %s", size, hp_kind_name(kind));
+	}
+
+	return ptr;
+}
+
+static void hp_hs_free_fn(void *ptr, size_t size, void *arg)
+{
+	(void)arg;
+
+	hp_free(ptr, size);
+
+	return;
+}
+
+const struct hs_alloc hp_hs_alloc = {
+	.alloc	= hp_hs_alloc_fn,
+	.free	= hp_hs_free_fn,
+	.arg	= NULL
+};
+
+/* A dTLB load miss counter of the calling thread and its children */
+int hp_tlb_open(void)
+{
+	int fd;
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+				  PERF_COUNT_HW_CACHE_OP_READ << 8 |
+				  PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = 1; /* and the threads it starts, see par_search() */
+
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+	return fd;
+}
+
+int hp_tlb_read(int fd, uint64_t *p_misses)
+{
+	if (fd < 0 || !p_misses) {
+		return -EINVAL;
+	}
+
+	if (read(fd, p_misses, sizeof(*p_misses)) != sizeof(*p_misses)) {
+		return -EIO;
+	}
+
+	return 0;
+}
+
+void hp_tlb_close(int fd)
+{
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return;
+}
@@ -0,0 +1,39 @@
+/*
+ *     Filename: hugepage.h
+ *  Description: Header file for huge page backed storage
+ */
+
+#ifndef __HUGEPAGE_H__
+#define __HUGEPAGE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hypersplit.h"
+
+#define HP_SIZE (2UL << 20)
+
+/* NUMA nodes hp_alloc_node() can bind to */
+#define HP_NODE_MAX 64
+
+enum {
+	HP_KIND_INV		= -1,
+	HP_KIND_HUGETLB = 0, /* reserved huge pages, MAP_HUGETLB */
+	HP_KIND_THP		= 1, /* transparent huge pages, MADV_HUGEPAGE */
+	HP_KIND_PAGE	= 2, /* base pages, huge pages unavailable */
+	HP_KIND_MAX		= 3
+};
+
+/* hs_clone() allocator placing a forest on huge pages */
+extern const struct hs_alloc hp_hs_alloc;
+
+
+void *hp_alloc(size_t size, int *p_kind);
+void *hp_alloc_node(size_t size, int node, int *p_kind);
+void hp_free(void *ptr, size_t size);
+const char *hp_kind_name(int kind);
+
+int hp_tlb_open(void);
+int hp_tlb_read(int fd, uint64_t *p_misses);
+void hp_tlb_close(int fd);
+
+#endif /* __HUGEPAGE_H__ */
@@ -20,6 +20,11 @@
 #include <limits.h>
 //#include <float.h>
 #include <sys/queue.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "impl.h"
 #include "utils.h"
@@ -39,35 +44,94 @@ struct hs_queue_entry {
 
 STAILQ_HEAD(hs_queue_head, hs_queue_entry);
 
+/* Nodes per slab of an intra-tree build, see hs_node_alloc() */
+#define HS_SLAB_BITS 10
+#define HS_SLAB_NODES (1 << HS_SLAB_BITS)
+#define HS_SLAB_MAX (1 << 16)
+
+/*
+ * Work of one intra-tree build worker: the owner pushes and pops at tail,
+ * thieves take the oldest entry, the largest subtree, at head
+ */
+struct hs_deque {
+	pthread_mutex_t			lock;
+	struct hs_queue_entry	**ents;
+	int						head, tail, size;
+} __attribute__((aligned(64)));
+
+/* State shared by the workers building one tree */
+struct hs_tree_build {
+	struct hs_node			*slabs[HS_SLAB_MAX];
+	int						slab_num;
+	int						pending; /* entries queued or being split */
+	int						failed;
+	int						thread_num;
+	struct hs_deque			*deques;
+};
+
 struct hs_runtime {
 	struct shadow_range		shadow_rngs[DIM_MAX];
 	int64_t					*shadow_pnts[DIM_MAX];
 	struct hsn_pool			node_pool;
+	struct hsk_pool			knode_pool;
 	struct hs_queue_head	wqh;
 	const struct partition	*part;
+	const struct hs_config	*cfg;
+	struct hs_bucket		*buckets;
+	struct hs_bucket_block	*blocks;
+	int						bucket_num, bucket_size;
+	int						block_num, block_size;
+	uint8_t					*lists;
+	uint32_t				*list_offs;
+	uint32_t				*list_hash; /* list id + 1, 0 if free */
+	size_t					list_size, list_cap;
+	int						list_num, list_offs_size, list_max;
 	struct hs_tree			*trees;
 	int						cur;
+	struct hs_tree_build	*tb; /* NULL unless building a tree in parallel */
+	int						worker;
+	ssize_t					slab_next, slab_end; /* free ids of own slab */
 };
 
 //////////////////////////////////////////////////
 
-static int hs_init(struct hs_runtime *hsrt, const struct partition *part);
+static int hs_init(struct hs_runtime *hsrt, const struct partition *part, const struct hs_config *cfg);
 static void hs_terminate(struct hs_runtime *hsrt);
+static int hs_scratch_init(struct hs_runtime *hsrt, const struct partition *part, const struct hs_config *cfg);
+static void hs_scratch_term(struct hs_runtime *hsrt);
 
 static int hs_trigger(struct hs_runtime *hsrt);
 static int hs_process(struct hs_runtime *hsrt);
 static int hs_gather(struct hs_runtime *hsrt);
+static int hs_build_subset(struct hs_runtime *hsrt);
+static int hs_build_parallel(struct hs_runtime *hsrt, int thread_num);
+static int hs_build_tree_parallel(struct hs_runtime *hsrt, int thread_num);
 static int hs_dim_decision(struct hs_runtime *hsrt, const struct hs_queue_entry *ent);
 static uint32_t hs_point_decision(const struct shadow_range *shadow_rng);
+static int hs_points_decision(const struct shadow_range *shadow_rng, int fanout, uint32_t *split_pnts);
 static int hs_spawn(struct hs_runtime *hsrt, struct hs_queue_entry *ent, int split_dim, int is_inplace);
+static ssize_t hs_bucket_add(struct hs_runtime *hsrt, const int *rule_id, int rule_num);
+static ssize_t hs_list_add(struct hs_runtime *hsrt, const int *rule_id, int rule_num);
+static int hs_is_leaf(const struct hs_runtime *hsrt, uint32_t (*space)[2], const int *rule_id, int rule_num);
+static int hs_kprocess(struct hs_runtime *hsrt);
+static int hs_kspawn(struct hs_runtime *hsrt, struct hs_queue_entry *ent, int split_dim, int child);
 static int hs_space_is_fully_covered(uint32_t (*left)[2], uint32_t (*right)[2]);
+static int hs_tree_pri_cmp(const void *left, const void *right);
+static int hs_tree_jump(struct hs_tree *p_tree, uint32_t offset);
+static void hs_tree_free(struct hs_tree *p_tree);
+static int hs_tree_remap(struct hs_tree *p_tree, const uint32_t *new_id, int new_num, uint32_t offset);
+static int hs_tree_dedup(struct hs_tree *p_tree, uint32_t offset);
+#ifdef ENABLE_COMPACT_NODE
+static int hs_tree_compact(struct hs_tree *p_tree, uint32_t offset);
+#endif
 
 //////////////////////////////////////////////////
 
-static int hs_init(struct hs_runtime *hsrt, const struct partition *part)
+/* Scratch of one builder: shadow ranges, pools, queue and leaf storage */
+static int hs_scratch_init(struct hs_runtime *hsrt, const struct partition *part,
+						   const struct hs_config *cfg)
 {
 	int i, null_flag = 0;
-	struct hs_tree *trees;
 	int64_t **shadow_pnts;
 	struct shadow_range *shadow_rngs;
 
@@ -85,10 +149,7 @@ static int hs_init(struct hs_runtime *hsrt, const struct partition *part)
 		}
 	}
 
-	trees = calloc(part->subset_num, sizeof(*trees));
-	if (null_flag || !trees) {
-		free(trees);
-
+	if (null_flag) {
 		for (i = 0; i < DIM_MAX; i++) {
 			free(shadow_rngs[i].cnts);
 			free(shadow_rngs[i].pnts);
@@ -98,26 +159,35 @@ static int hs_init(struct hs_runtime *hsrt, const struct partition *part)
 		return -ENOMEM;
 	}
 
-	//trees->depth_avg = 1000;
-
 	MPOOL_INIT(&hsrt->node_pool, p2roundup(part->rule_num) << 1);
+	MPOOL_INIT(&hsrt->knode_pool, p2roundup(part->rule_num) >> 1);
 	STAILQ_INIT(&hsrt->wqh);
 	hsrt->part = part;
-	hsrt->trees = trees;
+	hsrt->cfg = cfg;
+	hsrt->buckets = NULL;
+	hsrt->blocks = NULL;
+	hsrt->bucket_num = hsrt->bucket_size = 0;
+	hsrt->block_num = hsrt->block_size = 0;
+	hsrt->lists = NULL;
+	hsrt->list_offs = NULL;
+	hsrt->list_hash = NULL;
+	hsrt->list_size = hsrt->list_cap = 0;
+	hsrt->list_num = hsrt->list_offs_size = hsrt->list_max = 0;
+	hsrt->trees = NULL;
+	hsrt->tb = NULL;
+	hsrt->worker = 0;
+	hsrt->slab_next = hsrt->slab_end = 0;
 
 	return 0;
 }
 
-static void hs_terminate(struct hs_runtime *hsrt)
+static void hs_scratch_term(struct hs_runtime *hsrt)
 {
 	int i;
 	struct hs_queue_head *p_wqh = &hsrt->wqh;
 	int64_t **shadow_pnts = hsrt->shadow_pnts;
 	struct shadow_range *shadow_rngs = hsrt->shadow_rngs;
 
-	dbg("Enter");
-	fflush(NULL);
-
 	while (!STAILQ_EMPTY(p_wqh)) {
 		struct hs_queue_entry *ent = STAILQ_FIRST(p_wqh);
 		STAILQ_REMOVE_HEAD(p_wqh, e);
@@ -126,7 +196,12 @@ static void hs_terminate(struct hs_runtime *hsrt)
 	}
 
 	MPOOL_TERM(&hsrt->node_pool);
-	free(hsrt->trees);
+	MPOOL_TERM(&hsrt->knode_pool);
+	free(hsrt->buckets);
+	free(hsrt->blocks);
+	free(hsrt->lists);
+	free(hsrt->list_offs);
+	free(hsrt->list_hash);
 
 	for (i = 0; i < DIM_MAX; i++) {
 		free(shadow_rngs[i].cnts);
@@ -137,8 +212,38 @@ static void hs_terminate(struct hs_runtime *hsrt)
 	return;
 }
 
+static int hs_init(struct hs_runtime *hsrt, const struct partition *part,
+				   const struct hs_config *cfg)
+{
+	struct hs_tree *trees;
+
+	trees = calloc(part->subset_num, sizeof(*trees));
+	if (!trees || hs_scratch_init(hsrt, part, cfg)) {
+		free(trees);
+		return -ENOMEM;
+	}
+
+	//trees->depth_avg = 1000;
+
+	hsrt->trees = trees;
+
+	return 0;
+}
+
+static void hs_terminate(struct hs_runtime *hsrt)
+{
+	dbg("Enter");
+	fflush(NULL);
+
+	hs_scratch_term(hsrt);
+	free(hsrt->trees);
+
+	return;
+}
+
 static int hs_trigger(struct hs_runtime *hsrt)
 {
+	int i;
 	ssize_t node_id;
 	struct hs_tree *p_tree;
 	const struct rule_set *p_rs;
@@ -163,7 +268,14 @@ static int hs_trigger(struct hs_runtime *hsrt)
 	}
 
 	MPOOL_RESET(&hsrt->node_pool);
-	node_id = MPOOL_MALLOC(hsn_pool, &hsrt->node_pool);
+	MPOOL_RESET(&hsrt->knode_pool);
+	hsrt->bucket_num = hsrt->block_num = 0;
+	if (hsrt->cfg->fanout > 2) {
+		node_id = MPOOL_MALLOC(hsk_pool, &hsrt->knode_pool);
+	}
+	else {
+		node_id = MPOOL_MALLOC(hsn_pool, &hsrt->node_pool);
+	}
 	if (node_id == -1) {
 		return -ENOMEM;
 	}
@@ -171,19 +283,44 @@ static int hs_trigger(struct hs_runtime *hsrt)
 	p_tree = &hsrt->trees[hsrt->cur];
 	p_rs = &hsrt->part->subsets[hsrt->cur];
 
+	p_tree->pri_min = p_rs->rules[0].pri;
+	for (i = 1; i < p_rs->rule_num; i++) {
+		if (p_rs->rules[i].pri < p_tree->pri_min) {
+			p_tree->pri_min = p_rs->rules[i].pri;
+		}
+	}
+
 	/* There is no need to build trees: only the tree root */
-	if (hs_space_is_fully_covered(space, p_rs->rules[0].dims)) {
+	if (hs_space_is_fully_covered(space, p_rs->rules[0].dims) &&
+		hsrt->cfg->fanout > 2) {
+		struct hs_knode *p_knode = MPOOL_ADDR(&hsrt->knode_pool, node_id);
+		memset(p_knode, 0, sizeof(*p_knode));
+		for (i = 0; i < HS_KNODE_FANOUT - 1; i++) {
+			p_knode->thresholds[i] = UINT32_MAX;
+		}
+		p_knode->children[0] = p_rs->rules[0].pri;
+		p_tree->inode_num = p_tree->enode_num = p_tree->depth_max = 1;
+	}
+	else if (hs_is_leaf(hsrt, space, NULL, p_rs->rule_num)) {
 		struct hs_node *root_node = MPOOL_ADDR(&hsrt->node_pool, node_id);
 		root_node->threshold = UINT32_MAX;
 		root_node->dim = DIM_SIP;
 		root_node->lchild = p_rs->rules[0].pri;
+		if (hsrt->cfg->multi) {
+			ssize_t list_id = hs_list_add(hsrt, NULL, p_rs->rule_num);
+			if (list_id == -1) {
+				return -ENOMEM;
+			}
+
+			root_node->lchild = HS_BUCKET_FLAG | list_id;
+		}
 		p_tree->inode_num = p_tree->enode_num = p_tree->depth_max = 1;
 		//p_tree->depth_avg = 1.0;
 
 		/* The tree root needs split */
 	}
 	else {
-		int i, *rule_id = malloc(p_rs->rule_num * sizeof(*rule_id));
+		int *rule_id = malloc(p_rs->rule_num * sizeof(*rule_id));
 		struct hs_queue_entry *ent = malloc(sizeof(*ent));
 		if (!rule_id || !ent) {
 			free(ent);
@@ -206,54 +343,127 @@ static int hs_trigger(struct hs_runtime *hsrt)
 	return 0;
 }
 
-static int hs_process(struct hs_runtime *hsrt)
+/*
+ * Node storage and queue of the binary build. A serial build takes nodes
+ * from node_pool and entries from wqh; the workers of an intra-tree build
+ * take nodes from slabs of their own and push to their own deque.
+ */
+static inline struct hs_node *hs_node_addr(struct hs_runtime *hsrt,
+										   ssize_t node_id)
 {
-	struct hs_queue_head *p_wqh;
-	struct hs_queue_entry *ent;
+	if (hsrt->tb) {
+		return &hsrt->tb->slabs[node_id >> HS_SLAB_BITS]
+							   [node_id & (HS_SLAB_NODES - 1)];
+	}
 
-	dbg("Enter");
+	return MPOOL_ADDR(&hsrt->node_pool, node_id);
+}
 
-	/* The loop processes all internal nodes */
-	p_wqh = &hsrt->wqh;
-	while (!STAILQ_EMPTY(p_wqh)) {
-		int split_dim;
-		struct hs_node *p_node;
-		uint32_t split_pnt, orig_end, *split_rng;
+static ssize_t hs_node_alloc(struct hs_runtime *hsrt)
+{
+	int slab;
+	struct hs_tree_build *tb = hsrt->tb;
 
-		ent = STAILQ_FIRST(p_wqh);
-		STAILQ_REMOVE_HEAD(p_wqh, e);
-		
-		/* choose split dimension */
-		split_dim = hs_dim_decision(hsrt, ent);
-		if (split_dim <= DIM_INV || split_dim >= DIM_MAX) {
-			goto err;
+	if (!tb) {
+		return MPOOL_MALLOC(hsn_pool, &hsrt->node_pool);
+	}
+
+	if (hsrt->slab_next == hsrt->slab_end) {
+		slab = __atomic_fetch_add(&tb->slab_num, 1, __ATOMIC_RELAXED);
+		if (slab >= HS_SLAB_MAX) {
+			return -1;
 		}
 
-		/* choose split point */
-		assert(split_dim > DIM_INV && split_dim < DIM_MAX);
+		/* Published to the other workers with the entries on the nodes */
+		tb->slabs[slab] = malloc(HS_SLAB_NODES * sizeof(*tb->slabs[slab]));
+		if (!tb->slabs[slab]) {
+			return -1;
+		}
 
-		split_pnt = hs_point_decision(&hsrt->shadow_rngs[split_dim]);
+		hsrt->slab_next = (ssize_t)slab << HS_SLAB_BITS;
+		hsrt->slab_end = hsrt->slab_next + HS_SLAB_NODES;
+	}
 
-		p_node = MPOOL_ADDR(&hsrt->node_pool, ent->node_id);
-		p_node->dim = split_dim;
-		p_node->threshold = split_pnt;
+	return hsrt->slab_next++;
+}
 
-		/* process left child: require a new wqe */
-		split_rng = ent->space[split_dim];
-		orig_end = split_rng[1];
-		split_rng[1] = split_pnt;
+static int hs_queue_push(struct hs_runtime *hsrt, struct hs_queue_entry *ent)
+{
+	struct hs_deque *dq;
+	struct hs_queue_entry **ents;
 
-		if (hs_spawn(hsrt, ent, split_dim, 0)) {
-			goto err;
+	if (!hsrt->tb) {
+		STAILQ_INSERT_HEAD(&hsrt->wqh, ent, e);
+		return 0;
+	}
+
+	dq = &hsrt->tb->deques[hsrt->worker];
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail == dq->size) {
+		if (dq->head > dq->size >> 1) {
+			memmove(dq->ents, dq->ents + dq->head,
+					(dq->tail - dq->head) * sizeof(*dq->ents));
+			dq->tail -= dq->head;
+			dq->head = 0;
 		}
+		else {
+			ents = realloc(dq->ents, (dq->size << 1) * sizeof(*ents));
+			if (!ents) {
+				pthread_mutex_unlock(&dq->lock);
+				return -ENOMEM;
+			}
 
-		/* process right child: reuse current wqe */
-		split_rng[1] = orig_end, split_rng[0] = split_pnt + 1;
-		if (hs_spawn(hsrt, ent, split_dim, 1)) {
-			goto err;
+			dq->ents = ents;
+			dq->size <<= 1;
 		}
 	}
 
+	dq->ents[dq->tail++] = ent;
+	__atomic_fetch_add(&hsrt->tb->pending, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&dq->lock);
+
+	return 0;
+}
+
+/* Split the node of ent and queue its internal children */
+static int hs_split(struct hs_runtime *hsrt, struct hs_queue_entry *ent)
+{
+	int split_dim;
+	struct hs_node *p_node;
+	uint32_t split_pnt, orig_end, *split_rng;
+
+	/* choose split dimension */
+	split_dim = hs_dim_decision(hsrt, ent);
+	if (split_dim <= DIM_INV || split_dim >= DIM_MAX) {
+		goto err;
+	}
+
+	/* choose split point */
+	assert(split_dim > DIM_INV && split_dim < DIM_MAX);
+
+	split_pnt = hs_point_decision(&hsrt->shadow_rngs[split_dim]);
+
+	p_node = hs_node_addr(hsrt, ent->node_id);
+	p_node->dim = split_dim;
+	p_node->threshold = split_pnt;
+
+	/* process left child: require a new wqe */
+	split_rng = ent->space[split_dim];
+	orig_end = split_rng[1];
+	split_rng[1] = split_pnt;
+
+	if (hs_spawn(hsrt, ent, split_dim, 0)) {
+		goto err;
+	}
+
+	/* process right child: reuse current wqe */
+	split_rng[1] = orig_end, split_rng[0] = split_pnt + 1;
+	if (hs_spawn(hsrt, ent, split_dim, 1)) {
+		goto err;
+	}
+
 	return 0;
 
 err:
@@ -263,13 +473,38 @@ err:
 	return -ENOMEM;
 }
 
+static int hs_process(struct hs_runtime *hsrt)
+{
+	struct hs_queue_head *p_wqh;
+	struct hs_queue_entry *ent;
+
+	dbg("Enter");
+
+	if (hsrt->cfg->fanout > 2) {
+		return hs_kprocess(hsrt);
+	}
+
+	/* The loop processes all internal nodes */
+	p_wqh = &hsrt->wqh;
+	while (!STAILQ_EMPTY(p_wqh)) {
+		ent = STAILQ_FIRST(p_wqh);
+		STAILQ_REMOVE_HEAD(p_wqh, e);
+
+		if (hs_split(hsrt, ent)) {
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
 static int hs_gather(struct hs_runtime *hsrt)
 {
 	struct hs_node *root_node;
 	struct hs_tree *p_tree;
 	struct hsn_pool *p_node_pool;
 
-	int node_cnt;
+	int node_cnt, ret;
 
 	dbg("enter");
 
@@ -277,6 +512,29 @@ static int hs_gather(struct hs_runtime *hsrt)
 	node_cnt = MPOOL_COUNT(p_node_pool);
 	p_tree = &hsrt->trees[hsrt->cur];
 
+	if (hsrt->cfg->fanout > 2) {
+		struct hsk_pool *p_knode_pool = &hsrt->knode_pool;
+
+		node_cnt = MPOOL_COUNT(p_knode_pool);
+		if (p_tree->inode_num != node_cnt) {
+			return -EINVAL;
+		}
+
+		if (posix_memalign((void **)&p_tree->knodes, HS_CACHE_LINE,
+						   node_cnt * sizeof(*p_tree->knodes))) {
+			p_tree->knodes = NULL;
+			return -ENOMEM;
+		}
+
+		for (ret = 0; ret < node_cnt; ret++) {
+			p_tree->knodes[ret] = MPOOL_ELEMENT(p_knode_pool, ret);
+		}
+
+		p_tree->node_num = node_cnt;
+
+		return 0;
+	}
+
 	//assert(p_tree->inode_num == MPOOL_COUNT(p_node_pool));
 	//assert(p_tree->enode_num == p_tree->inode_num + 1);
 
@@ -292,9 +550,61 @@ static int hs_gather(struct hs_runtime *hsrt)
 
 	MPOOL_BASE(p_node_pool) = NULL;
 	p_tree->root_node = root_node;
+	p_tree->node_num = node_cnt;
 	//p_tree->depth_avg /= p_tree->enode_num;
 
+	if (hsrt->cfg->dedup) {
+		ret = hs_tree_dedup(p_tree,
+							hsrt->part->subsets[hsrt->cur].def_rule + 1);
+		if (ret) {
+			return ret;
+		}
+
+		dbg("Tree %d: %d of %d nodes left after dedup, saved %zu Bytes",
+			hsrt->cur, p_tree->node_num, node_cnt,
+			(node_cnt - p_tree->node_num) * sizeof(struct hs_node));
+	}
+
+	/* List leaves are only understood by hs_search_multi() */
+	if (hsrt->cfg->multi) {
+		p_tree->lists = hsrt->lists;
+		p_tree->list_offs = hsrt->list_offs;
+		p_tree->list_num = hsrt->list_num;
+		p_tree->list_max = hsrt->list_max;
+		hsrt->lists = NULL;
+		hsrt->list_offs = NULL;
+		hsrt->list_size = hsrt->list_cap = 0;
+		hsrt->list_num = hsrt->list_offs_size = hsrt->list_max = 0;
+
+		return 0;
+	}
+
+	/* Bucket leaves are only understood by hs_search_binth() */
+	if (hsrt->cfg->binth) {
+		p_tree->buckets = hsrt->buckets;
+		p_tree->bucket_num = hsrt->bucket_num;
+		p_tree->blocks = hsrt->blocks;
+		p_tree->block_num = hsrt->block_num;
+		hsrt->buckets = NULL;
+		hsrt->blocks = NULL;
+		hsrt->bucket_size = hsrt->block_size = 0;
+
+		return 0;
+	}
+
+	if (hsrt->cfg->jump) {
+		ret = hs_tree_jump(p_tree,
+						   hsrt->part->subsets[hsrt->cur].def_rule + 1);
+		if (ret) {
+			return ret;
+		}
+	}
+
+#ifdef ENABLE_COMPACT_NODE
+	return hs_tree_compact(p_tree, hsrt->part->subsets[hsrt->cur].def_rule + 1);
+#else
 	return 0;
+#endif
 }
 
 static int hs_dim_decision(struct hs_runtime			*hsrt,
@@ -385,26 +695,113 @@ static uint32_t hs_point_decision(const struct shadow_range *shadow_rng)
 	return shadow_rng->pnts[(i << 1) - 1];
 }
 
-static int hs_spawn(struct hs_runtime *hsrt, struct hs_queue_entry *ent,
-					int split_dim, int is_inplace)
+/*
+ * Up to fanout - 1 split points at the quantiles of the rule weight, the
+ * multi-way counterpart of hs_point_decision(). Returns the point number.
+ */
+static int hs_points_decision(const struct shadow_range *shadow_rng,
+							  int fanout, uint32_t *split_pnts)
 {
-	struct hs_node *p_node;
+	int i, pnt_num, rng_num_max;
+	long measure;
+
+	if (shadow_rng == NULL || shadow_rng->pnts == NULL ||
+		shadow_rng->cnts == NULL) {
+		dbg("Wrong !");
+		return 0;
+	}
+
+	rng_num_max = (shadow_rng->point_num >> 1) - 1;
+
+	for (measure = pnt_num = i = 0;
+		 i < rng_num_max && pnt_num < fanout - 1; i++) {
+		measure += shadow_rng->cnts[i];
+		if (measure * fanout >= (long)shadow_rng->total * (pnt_num + 1)) {
+			split_pnts[pnt_num++] = shadow_rng->pnts[(i << 1) + 1];
+		}
+	}
+
+	/* The weight sits in the last range: fall back to a binary cut */
+	if (!pnt_num && rng_num_max > 0) {
+		split_pnts[pnt_num++] = hs_point_decision(shadow_rng);
+	}
+
+	return pnt_num;
+}
+
+/* hs_process() for k-ary nodes: every entry splits into all its children */
+static int hs_kprocess(struct hs_runtime *hsrt)
+{
+	int i, split_dim, pnt_num;
+	uint32_t split_pnts[HS_KNODE_FANOUT - 1], *split_rng, orig_rng[2];
+	struct hs_knode *p_knode;
+	struct hs_queue_entry *ent;
+	struct hs_queue_head *p_wqh = &hsrt->wqh;
+
+	while (!STAILQ_EMPTY(p_wqh)) {
+		ent = STAILQ_FIRST(p_wqh);
+		STAILQ_REMOVE_HEAD(p_wqh, e);
+
+		split_dim = hs_dim_decision(hsrt, ent);
+		if (split_dim <= DIM_INV || split_dim >= DIM_MAX) {
+			goto err;
+		}
+
+		pnt_num = hs_points_decision(&hsrt->shadow_rngs[split_dim],
+									 hsrt->cfg->fanout, split_pnts);
+		if (!pnt_num) {
+			goto err;
+		}
+
+		p_knode = MPOOL_ADDR(&hsrt->knode_pool, ent->node_id);
+		memset(p_knode, 0, sizeof(*p_knode));
+		p_knode->dim = split_dim;
+		for (i = 0; i < HS_KNODE_FANOUT - 1; i++) {
+			p_knode->thresholds[i] = i < pnt_num ? split_pnts[i] : UINT32_MAX;
+		}
+
+		/* Child i covers (split_pnts[i - 1], split_pnts[i]] */
+		split_rng = ent->space[split_dim];
+		orig_rng[0] = split_rng[0], orig_rng[1] = split_rng[1];
+
+		for (i = 0; i <= pnt_num; i++) {
+			split_rng[0] = i ? split_pnts[i - 1] + 1 : orig_rng[0];
+			split_rng[1] = i < pnt_num ? split_pnts[i] : orig_rng[1];
+
+			if (hs_kspawn(hsrt, ent, split_dim, i)) {
+				goto err;
+			}
+		}
+
+		free(ent->rule_id);
+		free(ent);
+	}
+
+	return 0;
+
+err:
+	free(ent->rule_id);
+	free(ent);
+
+	return -ENOMEM;
+}
+
+static int hs_kspawn(struct hs_runtime *hsrt, struct hs_queue_entry *ent,
+					 int split_dim, int child)
+{
+	ssize_t node_id;
+	struct hs_knode *p_knode;
 	struct hs_queue_entry *p_new_wqe;
 	register int i, rid, new_rule_num, *new_rule_id;
 
 	struct hs_tree *p_tree = &hsrt->trees[hsrt->cur];
 	const struct rule_set *p_rs = &hsrt->part->subsets[hsrt->cur];
 	register const uint32_t *split_rng = ent->space[split_dim];
+	uint32_t offset = p_rs->def_rule + 1;
 
-	/* Get all intersected rules */
-	if (is_inplace) {
-		new_rule_id = ent->rule_id;
-	}
-	else {
-		new_rule_id = malloc(ent->rule_num * sizeof(*new_rule_id));
-		if (!new_rule_id) {
-			return -ENOMEM;
-		}
+	new_rule_id = malloc(ent->rule_num * sizeof(*new_rule_id));
+	if (!new_rule_id) {
+		return -ENOMEM;
 	}
 
 	for (new_rule_num = i = 0; i < ent->rule_num; i++) {
@@ -419,41 +816,144 @@ static int hs_spawn(struct hs_runtime *hsrt, struct hs_queue_entry *ent,
 	rid = new_rule_id[0];
 	if (hs_space_is_fully_covered(ent->space, p_rs->rules[rid].dims)) {
 		p_tree->enode_num++;
-		//p_tree->depth_avg += ent->depth;
 		if (ent->depth > p_tree->depth_max) {
 			p_tree->depth_max = ent->depth;
 		}
 
-		p_node = MPOOL_ADDR(&hsrt->node_pool, ent->node_id);
+		p_knode = MPOOL_ADDR(&hsrt->knode_pool, ent->node_id);
+		p_knode->children[child] = p_rs->rules[rid].pri;
 		free(new_rule_id);
-		if (is_inplace) {
-			free(ent);
-			p_node->rchild = p_rs->rules[rid].pri;
-		}
-		else {
-			p_node->lchild = p_rs->rules[rid].pri;
-		}
 
-		/* Internal node */
+		return 0;
 	}
-	else {
-		uint32_t offset = p_rs->def_rule + 1;
-		ssize_t node_id = MPOOL_MALLOC(hsn_pool, &hsrt->node_pool);
-		if (node_id == -1) {
-			goto err;
-		}
 
-		p_node = MPOOL_ADDR(&hsrt->node_pool, ent->node_id);
-		if (is_inplace) {
-			p_new_wqe = ent;
-			p_node->rchild = node_id + offset;
-		}
-		else {
-			p_new_wqe = malloc(sizeof(*p_new_wqe));
-			if (!p_new_wqe) {
-				goto err;
-			}
-			p_node->lchild = node_id + offset;
+	/* Internal node */
+	node_id = MPOOL_MALLOC(hsk_pool, &hsrt->knode_pool);
+	p_new_wqe = malloc(sizeof(*p_new_wqe));
+	if (node_id == -1 || !p_new_wqe) {
+		free(p_new_wqe);
+		free(new_rule_id);
+		return -ENOMEM;
+	}
+
+	/* the pool may have moved */
+	p_knode = MPOOL_ADDR(&hsrt->knode_pool, ent->node_id);
+	p_knode->children[child] = node_id + offset;
+
+	memcpy(p_new_wqe->space, ent->space, sizeof(p_new_wqe->space));
+	p_new_wqe->node_id = node_id;
+	p_new_wqe->rule_id = new_rule_id;
+	p_new_wqe->rule_num = new_rule_num;
+	p_new_wqe->depth = ent->depth + 1;
+	p_tree->inode_num++;
+	STAILQ_INSERT_HEAD(&hsrt->wqh, p_new_wqe, e);
+
+	return 0;
+}
+
+static int hs_spawn(struct hs_runtime *hsrt, struct hs_queue_entry *ent,
+					int split_dim, int is_inplace)
+{
+	struct hs_node *p_node;
+	struct hs_queue_entry *p_new_wqe;
+	register int i, rid, new_rule_num, *new_rule_id;
+
+	struct hs_tree *p_tree = &hsrt->trees[hsrt->cur];
+	const struct rule_set *p_rs = &hsrt->part->subsets[hsrt->cur];
+	register const uint32_t *split_rng = ent->space[split_dim];
+
+	/* Get all intersected rules */
+	if (is_inplace) {
+		new_rule_id = ent->rule_id;
+	}
+	else {
+		new_rule_id = malloc(ent->rule_num * sizeof(*new_rule_id));
+		if (!new_rule_id) {
+			return -ENOMEM;
+		}
+	}
+
+	for (new_rule_num = i = 0; i < ent->rule_num; i++) {
+		rid = ent->rule_id[i];
+		if (p_rs->rules[rid].dims[split_dim][0] <= split_rng[1] &&
+			p_rs->rules[rid].dims[split_dim][1] >= split_rng[0]) {
+			new_rule_id[new_rule_num++] = rid;
+		}
+	}
+
+	/* External node */
+	rid = new_rule_id[0];
+	if (hs_is_leaf(hsrt, ent->space, new_rule_id, new_rule_num)) {
+		uint32_t leaf = p_rs->rules[rid].pri;
+
+		if (hsrt->cfg->multi) {
+			ssize_t list_id = hs_list_add(hsrt, new_rule_id, new_rule_num);
+			if (list_id == -1) {
+				goto err;
+			}
+
+			leaf = HS_BUCKET_FLAG | list_id;
+		}
+
+		p_tree->enode_num++;
+		//p_tree->depth_avg += ent->depth;
+		if (ent->depth > p_tree->depth_max) {
+			p_tree->depth_max = ent->depth;
+		}
+
+		p_node = hs_node_addr(hsrt, ent->node_id);
+		free(new_rule_id);
+		if (is_inplace) {
+			free(ent);
+			p_node->rchild = leaf;
+		}
+		else {
+			p_node->lchild = leaf;
+		}
+
+		/* Bucket */
+	}
+	else if (new_rule_num <= hsrt->cfg->binth) {
+		ssize_t bucket_id = hs_bucket_add(hsrt, new_rule_id, new_rule_num);
+		if (bucket_id == -1) {
+			goto err;
+		}
+
+		p_tree->enode_num++;
+		if (ent->depth > p_tree->depth_max) {
+			p_tree->depth_max = ent->depth;
+		}
+
+		p_node = hs_node_addr(hsrt, ent->node_id);
+		free(new_rule_id);
+		if (is_inplace) {
+			free(ent);
+			p_node->rchild = HS_BUCKET_FLAG | bucket_id;
+		}
+		else {
+			p_node->lchild = HS_BUCKET_FLAG | bucket_id;
+		}
+
+		/* Internal node */
+	}
+	else {
+		uint32_t offset = p_rs->def_rule + 1;
+		ssize_t node_id = hs_node_alloc(hsrt);
+		if (node_id == -1) {
+			goto err;
+		}
+
+		p_node = hs_node_addr(hsrt, ent->node_id);
+		if (is_inplace) {
+			p_new_wqe = ent;
+			p_node->rchild = node_id + offset;
+		}
+		else {
+			p_new_wqe = malloc(sizeof(*p_new_wqe));
+			if (!p_new_wqe) {
+				goto err;
+			}
+			p_node->lchild = node_id + offset;
 			memcpy(p_new_wqe->space, ent->space, sizeof(p_new_wqe->space));
 			p_new_wqe->rule_id = new_rule_id;
 		}
@@ -461,177 +961,2377 @@ static int hs_spawn(struct hs_runtime *hsrt, struct hs_queue_entry *ent,
 		p_new_wqe->rule_num = new_rule_num;
 		p_new_wqe->depth = ent->depth + 1;
 		p_tree->inode_num++;
-		STAILQ_INSERT_HEAD(&hsrt->wqh, p_new_wqe, e);
+		if (hs_queue_push(hsrt, p_new_wqe)) {
+			if (!is_inplace) {
+				free(p_new_wqe);
+			}
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	if (!is_inplace) {
+		free(new_rule_id);
+	}
+
+	return -ENOMEM;
+}
+
+/* Store the rules as a new bucket in ascending priority, returns its id */
+static ssize_t hs_bucket_add(struct hs_runtime *hsrt, const int *rule_id,
+							 int rule_num)
+{
+	int i, j, d, block_num, *order;
+	struct hs_bucket_block *p_block;
+	const struct rule *p_rule;
+	const struct rule_set *p_rs = &hsrt->part->subsets[hsrt->cur];
+
+	block_num = (rule_num + HS_BUCKET_LANES - 1) / HS_BUCKET_LANES;
+
+	if (hsrt->bucket_num == hsrt->bucket_size) {
+		int size = hsrt->bucket_size ? hsrt->bucket_size << 1 : 64;
+		struct hs_bucket *buckets = realloc(hsrt->buckets,
+											size * sizeof(*buckets));
+		if (!buckets) {
+			return -1;
+		}
+
+		hsrt->buckets = buckets;
+		hsrt->bucket_size = size;
+	}
+
+	if (hsrt->block_num + block_num > hsrt->block_size) {
+		int size = hsrt->block_size ? hsrt->block_size << 1 : 64;
+		struct hs_bucket_block *blocks;
+
+		while (size < hsrt->block_num + block_num) {
+			size <<= 1;
+		}
+
+		blocks = realloc(hsrt->blocks, size * sizeof(*blocks));
+		if (!blocks) {
+			return -1;
+		}
+
+		hsrt->blocks = blocks;
+		hsrt->block_size = size;
+	}
+
+	order = malloc(rule_num * sizeof(*order));
+	if (!order) {
+		return -1;
+	}
+
+	/* Insertion sort by priority, buckets are small */
+	for (i = 0; i < rule_num; i++) {
+		for (j = i; j > 0 && p_rs->rules[order[j - 1]].pri >
+							 p_rs->rules[rule_id[i]].pri; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = rule_id[i];
+	}
+
+	p_block = &hsrt->blocks[hsrt->block_num];
+	for (i = 0; i < block_num * HS_BUCKET_LANES; i++) {
+		j = i % HS_BUCKET_LANES;
+
+		if (i < rule_num) {
+			p_rule = &p_rs->rules[order[i]];
+			for (d = 0; d < DIM_MAX; d++) {
+				p_block->lo[d][j] = p_rule->dims[d][0];
+				p_block->hi[d][j] = p_rule->dims[d][1];
+			}
+			p_block->pri[j] = p_rule->pri;
+		}
+		else {
+			for (d = 0; d < DIM_MAX; d++) {
+				p_block->lo[d][j] = UINT32_MAX;
+				p_block->hi[d][j] = 0;
+			}
+			p_block->pri[j] = INT_MAX;
+		}
+
+		if (j == HS_BUCKET_LANES - 1) {
+			p_block++;
+		}
+	}
+
+	free(order);
+
+	hsrt->buckets[hsrt->bucket_num].block = hsrt->block_num;
+	hsrt->buckets[hsrt->bucket_num].block_num = block_num;
+	hsrt->block_num += block_num;
+
+	return hsrt->bucket_num++;
+}
+
+static inline int hs_varint_put(uint8_t *p, uint32_t value)
+{
+	int len = 0;
+
+	while (value >= 0x80) {
+		p[len++] = value | 0x80;
+		value >>= 7;
+	}
+	p[len++] = value;
+
+	return len;
+}
+
+static inline uint32_t hs_varint_get(const uint8_t **p_pos)
+{
+	int shift = 0;
+	uint32_t value = 0;
+	const uint8_t *p = *p_pos;
+
+	while (*p & 0x80) {
+		value |= (uint32_t)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	value |= (uint32_t)*p++ << shift;
+	*p_pos = p;
+
+	return value;
+}
+
+static uint32_t hs_list_hash(const uint8_t *p, int len)
+{
+	int i;
+	uint32_t h = 2166136261U;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 16777619U;
+	}
+
+	return h;
+}
+
+/* Grow the list ids and rehash them into a table twice as large */
+static int hs_list_grow(struct hs_runtime *hsrt)
+{
+	int i, size = hsrt->list_offs_size ? hsrt->list_offs_size << 1 : 64;
+	uint32_t h, mask = (size << 1) - 1, *list_hash, *list_offs;
+
+	list_offs = realloc(hsrt->list_offs, size * sizeof(*list_offs));
+	if (!list_offs) {
+		return -ENOMEM;
+	}
+
+	hsrt->list_offs = list_offs;
+	list_offs[0] = hsrt->list_num ? list_offs[0] : 0;
+
+	list_hash = calloc(mask + 1, sizeof(*list_hash));
+	if (!list_hash) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < hsrt->list_num; i++) {
+		h = hs_list_hash(hsrt->lists + list_offs[i],
+						 list_offs[i + 1] - list_offs[i]);
+		while (list_hash[h & mask]) {
+			h++;
+		}
+		list_hash[h & mask] = i + 1;
+	}
+
+	free(hsrt->list_hash);
+	hsrt->list_hash = list_hash;
+	hsrt->list_offs_size = size;
+
+	return 0;
+}
+
+/*
+ * Encode the best rules of a multi-match leaf, up to cfg->multi, and return
+ * the id of the list. Leaves with the same rules share one list.
+ */
+static ssize_t hs_list_add(struct hs_runtime *hsrt, const int *rule_id,
+						   int rule_num)
+{
+	int i, len, num;
+	uint32_t h, mask, id, pri, last = 0;
+	uint8_t *p;
+	const struct rule_set *p_rs = &hsrt->part->subsets[hsrt->cur];
+
+	num = rule_num < hsrt->cfg->multi ? rule_num : hsrt->cfg->multi;
+
+	if (hsrt->list_num + 2 > hsrt->list_offs_size && hs_list_grow(hsrt)) {
+		return -1;
+	}
+
+	/* A varint takes up to 5 bytes */
+	if (hsrt->list_size + (num + 1) * 5 > hsrt->list_cap) {
+		size_t cap = hsrt->list_cap ? hsrt->list_cap << 1 : 4096;
+		uint8_t *lists;
+
+		while (cap < hsrt->list_size + (num + 1) * 5) {
+			cap <<= 1;
+		}
+
+		lists = realloc(hsrt->lists, cap);
+		if (!lists) {
+			return -1;
+		}
+
+		hsrt->lists = lists;
+		hsrt->list_cap = cap;
+	}
+
+	/* Rules come in ascending priority, as for single match leaves */
+	p = hsrt->lists + hsrt->list_size;
+	len = hs_varint_put(p, num);
+	for (i = 0; i < num; i++) {
+		pri = p_rs->rules[rule_id ? rule_id[i] : i].pri;
+		len += hs_varint_put(p + len, pri - last);
+		last = pri;
+	}
+
+	mask = (hsrt->list_offs_size << 1) - 1;
+	for (h = hs_list_hash(p, len); hsrt->list_hash[h & mask]; h++) {
+		id = hsrt->list_hash[h & mask] - 1;
+		if (hsrt->list_offs[id + 1] - hsrt->list_offs[id] == (uint32_t)len &&
+			!memcmp(hsrt->lists + hsrt->list_offs[id], p, len)) {
+			return id;
+		}
+	}
+
+	id = hsrt->list_num++;
+	hsrt->list_hash[h & mask] = id + 1;
+	hsrt->list_size += len;
+	hsrt->list_offs[id + 1] = hsrt->list_size;
+	if (num > hsrt->list_max) {
+		hsrt->list_max = num;
+	}
+
+	return id;
+}
+
+/*
+ * A leaf needs its best rule to cover the space, or with multi-match its
+ * best cfg->multi rules. rule_id NULL stands for all rules of the subset.
+ */
+static int hs_is_leaf(const struct hs_runtime *hsrt, uint32_t (*space)[2],
+					  const int *rule_id, int rule_num)
+{
+	int i, num = 1;
+	const struct rule_set *p_rs = &hsrt->part->subsets[hsrt->cur];
+
+	if (hsrt->cfg->multi) {
+		num = rule_num < hsrt->cfg->multi ? rule_num : hsrt->cfg->multi;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (!hs_space_is_fully_covered(space,
+				p_rs->rules[rule_id ? rule_id[i] : i].dims)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int hs_space_is_fully_covered(uint32_t (*left)[2], uint32_t (*right)[2])
+{
+	int i;
+
+	//assert(left && right);
+
+	if (left == NULL || right == NULL) {
+		return 0;
+	}
+
+	for (i = 0; i < DIM_MAX; i++) {
+		/* left is fully covered by right */
+		if (left[i][0] < right[i][0] || left[i][1] > right[i][1]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Move node i of p_tree to slot new_id[i] of a new cache line aligned array
+ * with new_num slots, and rewrite the children accordingly. Unused slots
+ * are zeroed and never reached by the search.
+ */
+static int hs_tree_remap(struct hs_tree *p_tree, const uint32_t *new_id,
+						 int new_num, uint32_t offset)
+{
+	int i;
+	struct hs_node *nodes, *p_node;
+
+	if (posix_memalign((void **)&nodes, HS_CACHE_LINE,
+					   new_num * sizeof(*nodes))) {
+		return -ENOMEM;
+	}
+
+	memset(nodes, 0, new_num * sizeof(*nodes));
+
+	for (i = 0; i < p_tree->node_num; i++) {
+		if (new_id[i] == UINT32_MAX) {
+			continue;
+		}
+
+		p_node = &nodes[new_id[i]];
+		*p_node = p_tree->root_node[i];
+
+		if (p_node->lchild >= offset && !(p_node->lchild & HS_BUCKET_FLAG)) {
+			p_node->lchild = new_id[p_node->lchild - offset] + offset;
+		}
+
+		if (p_node->rchild >= offset && !(p_node->rchild & HS_BUCKET_FLAG)) {
+			p_node->rchild = new_id[p_node->rchild - offset] + offset;
+		}
+	}
+
+	if (p_tree->jump) {
+		for (i = 0; i < (1 << p_tree->jump_bits); i++) {
+			if (p_tree->jump[i] >= offset) {
+				p_tree->jump[i] = new_id[p_tree->jump[i] - offset] + offset;
+			}
+		}
+	}
+
+	free(p_tree->root_node);
+	p_tree->root_node = nodes;
+	p_tree->node_num = new_num;
+
+	return 0;
+}
+
+static inline int hs_node_is_same(const struct hs_node *left,
+								  const struct hs_node *right)
+{
+	return left->threshold == right->threshold && left->dim == right->dim &&
+		   left->lchild == right->lchild && left->rchild == right->rchild;
+}
+
+static inline uint32_t hs_node_hash(const struct hs_node *p_node)
+{
+	uint64_t h = p_node->threshold;
+
+	h = (h ^ p_node->dim) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p_node->lchild) * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ p_node->rchild) * 0x9e3779b97f4a7c15ULL;
+
+	return h >> 32;
+}
+
+/*
+ * Hash-cons the subtrees bottom up: a node whose (dim, threshold,
+ * children) was seen before is replaced by the first one, so the tree
+ * becomes a DAG. Children are allocated after their parent, so walking
+ * the ids backwards visits both children before the node.
+ */
+static int hs_tree_dedup(struct hs_tree *p_tree, uint32_t offset)
+{
+	int i, ret, new_num;
+	uint32_t h, mask, *table, *canon, *new_id;
+	struct hs_node *p_node;
+
+	mask = (p2roundup(p_tree->node_num) << 1) - 1;
+	table = malloc((mask + 1) * sizeof(*table));
+	canon = malloc(p_tree->node_num * sizeof(*canon));
+	new_id = malloc(p_tree->node_num * sizeof(*new_id));
+	if (!table || !canon || !new_id) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	memset(table, 0xff, (mask + 1) * sizeof(*table));
+
+	for (i = p_tree->node_num - 1; i >= 0; i--) {
+		p_node = &p_tree->root_node[i];
+
+		if (p_node->lchild >= offset && !(p_node->lchild & HS_BUCKET_FLAG)) {
+			p_node->lchild = canon[p_node->lchild - offset] + offset;
+		}
+
+		if (p_node->rchild >= offset && !(p_node->rchild & HS_BUCKET_FLAG)) {
+			p_node->rchild = canon[p_node->rchild - offset] + offset;
+		}
+
+		for (h = hs_node_hash(p_node) & mask; table[h] != UINT32_MAX;
+			 h = (h + 1) & mask) {
+			if (hs_node_is_same(&p_tree->root_node[table[h]], p_node)) {
+				break;
+			}
+		}
+
+		if (table[h] == UINT32_MAX) {
+			table[h] = i;
+		}
+
+		canon[i] = table[h];
+	}
+
+	/* Nothing refers to a duplicate any more: drop them */
+	for (new_num = i = 0; i < p_tree->node_num; i++) {
+		new_id[i] = canon[i] == i ? new_num++ : UINT32_MAX;
+	}
+
+	ret = 0;
+	if (new_num < p_tree->node_num) {
+		ret = hs_tree_remap(p_tree, new_id, new_num, offset);
+		p_tree->dag = 1;
+	}
+
+out:
+	free(new_id);
+	free(canon);
+	free(table);
+
+	return ret;
+}
+
+/*
+ * Resolve the root walk for the key range [lo, hi] of dim: follow nodes
+ * splitting on dim as long as the whole range goes one way. Return the id
+ * of the first node not fully determined by the range, or a leaf.
+ */
+static uint32_t hs_jump_resolve(const struct hs_tree *p_tree, int dim,
+								uint32_t lo, uint32_t hi, uint32_t offset,
+								int *depth)
+{
+	uint32_t id = offset;
+	const struct hs_node *p_node;
+
+	for (*depth = 0; id >= offset; (*depth)++) {
+		p_node = p_tree->root_node + id - offset;
+		if (p_node->dim != dim) {
+			break;
+		}
+
+		if (hi <= p_node->threshold) {
+			id = p_node->lchild;
+		}
+		else if (lo > p_node->threshold) {
+			id = p_node->rchild;
+		}
+		else {
+			break;
+		}
+	}
+
+	return id;
+}
+
+/*
+ * Build a root jump table indexed by the top jump_bits bits of the
+ * dimension split most often near the root. The bit count is the one with
+ * the best average levels skipped minus HS_JUMP_BIT_COST per bit; no table
+ * is built if it does not pay off.
+ */
+static int hs_tree_jump(struct hs_tree *p_tree, uint32_t offset)
+{
+	static const int dim_bits[DIM_MAX] = {
+		32, 32, 16, 16, 8,
+#ifdef ENABLE_NIC
+		32
+#endif
+	};
+	int i, k, dim, bits, depth, head, tail, best_bits;
+	int dim_cnts[DIM_MAX] = { 0 };
+	uint32_t *queue, *seen, id, lo, span;
+	double saved, best;
+	const struct hs_node *p_node;
+
+	p_tree->jump = NULL;
+	p_tree->jump_bits = 0;
+
+	/*
+	 * Most split dimension over the top levels. A dedup'ed tree shares
+	 * nodes between parents: count and queue each node once.
+	 */
+	queue = malloc(p_tree->node_num * sizeof(*queue));
+	seen = calloc((p_tree->node_num + 31) / 32, sizeof(*seen));
+	if (!queue || !seen) {
+		free(seen);
+		free(queue);
+		return -ENOMEM;
+	}
+
+	head = tail = 0;
+	queue[tail++] = 0;
+	seen[0] = 1;
+	for (i = 0; i < (1 << HS_JUMP_BITS_MAX) - 1 && head < tail; i++) {
+		p_node = &p_tree->root_node[queue[head++]];
+		dim_cnts[p_node->dim]++;
+
+		for (k = 0; k < 2; k++) {
+			id = k ? p_node->rchild : p_node->lchild;
+			if (id < offset) {
+				continue;
+			}
+
+			id -= offset;
+			if (!(seen[id >> 5] & 1U << (id & 31))) {
+				seen[id >> 5] |= 1U << (id & 31);
+				queue[tail++] = id;
+			}
+		}
+	}
+
+	free(seen);
+	free(queue);
+
+	for (dim = i = 0; i < DIM_MAX; i++) {
+		if (dim_cnts[i] > dim_cnts[dim]) {
+			dim = i;
+		}
+	}
+
+	/* Pick the table size */
+	best = 1.0, best_bits = 0;
+	for (bits = 1; bits <= MIN(HS_JUMP_BITS_MAX, dim_bits[dim]); bits++) {
+		span = (uint32_t)(1ULL << (dim_bits[dim] - bits));
+
+		for (saved = 0, k = 0; k < (1 << bits); k++) {
+			lo = k * span;
+			hs_jump_resolve(p_tree, dim, lo, lo + span - 1, offset, &depth);
+			saved += depth;
+		}
+
+		saved = saved / (1 << bits) - bits * HS_JUMP_BIT_COST;
+		if (saved > best) {
+			best = saved, best_bits = bits;
+		}
+	}
+
+	if (!best_bits) {
+		return 0;
+	}
+
+	p_tree->jump = malloc((1 << best_bits) * sizeof(*p_tree->jump));
+	if (!p_tree->jump) {
+		return -ENOMEM;
+	}
+
+	span = (uint32_t)(1ULL << (dim_bits[dim] - best_bits));
+	for (k = 0; k < (1 << best_bits); k++) {
+		lo = k * span;
+		p_tree->jump[k] = hs_jump_resolve(p_tree, dim, lo, lo + span - 1,
+										  offset, &depth);
+	}
+
+	p_tree->jump_dim = dim;
+	p_tree->jump_shift = dim_bits[dim] - best_bits;
+	p_tree->jump_bits = best_bits;
+
+	return 0;
+}
+
+static int hs_tree_pri_cmp(const void *left, const void *right)
+{
+	const struct hs_tree *p_left = left, *p_right = right;
+
+	return (p_left->pri_min > p_right->pri_min) -
+		   (p_left->pri_min < p_right->pri_min);
+}
+
+static void hs_tree_free(struct hs_tree *p_tree)
+{
+	free(p_tree->root_node);
+	free(p_tree->knodes);
+	free(p_tree->buckets);
+	free(p_tree->blocks);
+	free(p_tree->lists);
+	free(p_tree->list_offs);
+	free(p_tree->jump);
+#ifdef ENABLE_COMPACT_NODE
+	free(p_tree->cnodes);
+	free(p_tree->wnodes);
+#endif
+
+	return;
+}
+
+#ifdef ENABLE_COMPACT_NODE
+/*
+ * Encode the wide tree as struct hs_cnode in depth first order. Nodes whose
+ * leaf priority or right child distance overflow the compact fields fall
+ * back to a wide node.
+ */
+static int hs_tree_compact(struct hs_tree *p_tree, uint32_t offset)
+{
+	int i, top, cnode_num, wnode_num, wnode_size;
+	uint32_t *cid, *order, *stack, lchild, rchild;
+	struct hs_cnode *cnodes, *p_cnode;
+	struct hs_node *wnodes, *p_wnode;
+	const struct hs_node *p_node;
+
+	cid = malloc(p_tree->node_num * sizeof(*cid));
+	order = malloc(p_tree->node_num * sizeof(*order));
+	stack = malloc(p_tree->node_num * sizeof(*stack));
+	if (!cid || !order || !stack) {
+		goto err;
+	}
+
+	/* Depth first, left child first */
+	cnode_num = top = 0;
+	stack[top++] = 0;
+
+	while (top > 0) {
+		i = stack[--top];
+		cid[i] = cnode_num;
+		order[cnode_num++] = i;
+
+		p_node = &p_tree->root_node[i];
+		if (p_node->rchild >= offset) {
+			stack[top++] = p_node->rchild - offset;
+		}
+
+		if (p_node->lchild >= offset) {
+			stack[top++] = p_node->lchild - offset;
+		}
+	}
+
+	if (posix_memalign((void **)&cnodes, HS_CACHE_LINE,
+					   cnode_num * sizeof(*cnodes))) {
+		goto err;
+	}
+
+	wnodes = NULL;
+	wnode_num = wnode_size = 0;
+
+	for (i = 0; i < cnode_num; i++) {
+		p_node = &p_tree->root_node[order[i]];
+		p_cnode = &cnodes[i];
+
+		if (p_node->lchild >= offset) {
+			lchild = CNODE_NEXT;
+		}
+		else {
+			lchild = p_node->lchild < CNODE_NEXT ? p_node->lchild : UINT32_MAX;
+		}
+
+		if (p_node->rchild >= offset) {
+			rchild = cid[p_node->rchild - offset] - i;
+			rchild = rchild < CNODE_LEAF ? rchild : UINT32_MAX;
+		}
+		else {
+			rchild = p_node->rchild < CNODE_LEAF ?
+					 p_node->rchild | CNODE_LEAF : UINT32_MAX;
+		}
+
+		p_cnode->threshold = p_node->threshold;
+
+		if (lchild != UINT32_MAX && rchild != UINT32_MAX) {
+			p_cnode->dim = p_node->dim;
+			p_cnode->lchild = lchild;
+			p_cnode->rchild = rchild;
+			continue;
+		}
+
+		/* Wide fallback */
+		if (wnode_num == wnode_size) {
+			wnode_size = wnode_size ? wnode_size << 1 : 16;
+			p_wnode = realloc(wnodes, wnode_size * sizeof(*wnodes));
+			if (!p_wnode) {
+				free(wnodes);
+				free(cnodes);
+				goto err;
+			}
+			wnodes = p_wnode;
+		}
+
+		p_wnode = &wnodes[wnode_num];
+		*p_wnode = *p_node;
+
+		if (p_node->lchild >= offset) {
+			p_wnode->lchild = cid[p_node->lchild - offset] + offset;
+		}
+
+		if (p_node->rchild >= offset) {
+			p_wnode->rchild = cid[p_node->rchild - offset] + offset;
+		}
+
+		p_cnode->dim = CNODE_DIM_WIDE;
+		p_cnode->lchild = wnode_num >> CNODE_RCHILD_BITS;
+		p_cnode->rchild = wnode_num & ((1 << CNODE_RCHILD_BITS) - 1);
+		wnode_num++;
+	}
+
+	free(p_tree->cnodes);
+	free(p_tree->wnodes);
+	p_tree->cnodes = cnodes;
+	p_tree->wnodes = wnodes;
+	p_tree->cnode_num = cnode_num;
+	p_tree->wnode_num = wnode_num;
+
+	free(stack);
+	free(order);
+	free(cid);
+
+	return 0;
+
+err:
+	free(stack);
+	free(order);
+	free(cid);
+
+	return -ENOMEM;
+}
+
+int hs_compact(void *built_result)
+{
+	int j, ret;
+	struct hs_result *hsret;
+
+	if (!built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	/* The arrays of a clone cannot be reallocated */
+	if (!hsret || !hsret->trees || hsret->region) {
+		return -EINVAL;
+	}
+
+	for (j = 0; j < hsret->tree_num; j++) {
+		ret = hs_tree_compact(&hsret->trees[j], hsret->def_rule + 1);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/* Build the tree of subset hsrt->cur */
+static int hs_build_subset(struct hs_runtime *hsrt)
+{
+	int ret;
+
+	/* trigger entry enqueue */
+	ret = hs_trigger(hsrt);
+	if (ret) {
+		return ret;
+	}
+
+	/* hypersplit building */
+	ret = hs_process(hsrt);
+	if (ret) {
+		return ret;
+	}
+
+	/* write subset result */
+	return hs_gather(hsrt);
+}
+
+/* Take the newest entry of the own deque, or steal the oldest of another */
+static struct hs_queue_entry *hs_queue_take(struct hs_runtime *hsrt)
+{
+	int i;
+	struct hs_deque *dq;
+	struct hs_queue_entry *ent = NULL;
+	struct hs_tree_build *tb = hsrt->tb;
+
+	dq = &tb->deques[hsrt->worker];
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		ent = dq->ents[--dq->tail];
+	}
+	if (dq->tail == dq->head) {
+		dq->head = dq->tail = 0;
+	}
+	pthread_mutex_unlock(&dq->lock);
+
+	for (i = 1; !ent && i < tb->thread_num; i++) {
+		dq = &tb->deques[(hsrt->worker + i) % tb->thread_num];
+		pthread_mutex_lock(&dq->lock);
+		if (dq->tail > dq->head) {
+			ent = dq->ents[dq->head++];
+		}
+		pthread_mutex_unlock(&dq->lock);
+	}
+
+	return ent;
+}
+
+static void *hs_tree_worker_run(void *arg)
+{
+	struct hs_runtime *hsrt = arg;
+	struct hs_tree_build *tb = hsrt->tb;
+	struct hs_queue_entry *ent;
+
+	while (!__atomic_load_n(&tb->failed, __ATOMIC_RELAXED)) {
+		ent = hs_queue_take(hsrt);
+		if (!ent) {
+			/* Nothing queued and nothing being split: the tree is done */
+			if (!__atomic_load_n(&tb->pending, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+
+			sched_yield();
+			continue;
+		}
+
+		if (hs_split(hsrt, ent)) {
+			__atomic_store_n(&tb->failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+
+		/* After the children are queued, so pending never drops to 0 early */
+		__atomic_fetch_sub(&tb->pending, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Give the nodes the ids the serial build would have: hs_process() pops
+ * the newest entry first and allocates both children of a node when it
+ * splits it, so replaying that walk from the root numbers every node the
+ * same way, whichever worker built it and whatever slab it landed in.
+ */
+static struct hs_node *hs_tree_build_gather(const struct hs_runtime *hsrt,
+											const struct hs_tree_build *tb,
+											int node_num)
+{
+	int top = 0, next = 0;
+	uint32_t id, child, *new_id, *stack;
+	struct hs_node *nodes, *p_node;
+	uint32_t offset = hsrt->part->subsets[hsrt->cur].def_rule + 1;
+
+	nodes = malloc(node_num * sizeof(*nodes));
+	stack = malloc(node_num * sizeof(*stack));
+	new_id = malloc(((size_t)tb->slab_num << HS_SLAB_BITS) * sizeof(*new_id));
+	if (!nodes || !stack || !new_id) {
+		goto err;
+	}
+
+	new_id[0] = next++;
+	stack[top++] = 0;
+
+	while (top) {
+		id = stack[--top];
+		p_node = &nodes[new_id[id]];
+		*p_node = tb->slabs[id >> HS_SLAB_BITS][id & (HS_SLAB_NODES - 1)];
+
+		if (p_node->lchild >= offset) {
+			child = p_node->lchild - offset;
+			if (next == node_num) {
+				goto err;
+			}
+			new_id[child] = next++;
+			p_node->lchild = new_id[child] + offset;
+			stack[top++] = child;
+		}
+
+		if (p_node->rchild >= offset) {
+			child = p_node->rchild - offset;
+			if (next == node_num) {
+				goto err;
+			}
+			new_id[child] = next++;
+			p_node->rchild = new_id[child] + offset;
+			stack[top++] = child;
+		}
+	}
+
+	free(new_id);
+	free(stack);
+
+	if (next != node_num) {
+		free(nodes);
+		return NULL;
+	}
+
+	return nodes;
+
+err:
+	free(new_id);
+	free(stack);
+	free(nodes);
+
+	return NULL;
+}
+
+/* Intra-tree builds split binary nodes only, leaves being single rules */
+static inline int hs_tree_parallel_ok(const struct hs_config *cfg)
+{
+	return cfg->fanout == 2 && !cfg->binth && !cfg->multi;
+}
+
+/*
+ * Build the tree of subset hsrt->cur with thread_num workers stealing
+ * entries from each other. Every worker has its own scratch, deque and
+ * node slabs; node ids are temporary until hs_tree_build_gather() packs
+ * the slabs into the array hs_gather() expects. On failure the tree is
+ * left empty.
+ */
+static int hs_build_tree_parallel(struct hs_runtime *hsrt, int thread_num)
+{
+	int i, ret;
+	pthread_t *tids = NULL;
+	struct hs_tree_build *tb = NULL;
+	struct hs_runtime *workers = NULL;
+	struct hs_queue_entry *ent;
+	struct hs_node *nodes;
+	struct hs_deque *dq;
+	struct hs_tree *p_tree = &hsrt->trees[hsrt->cur];
+
+	ret = hs_trigger(hsrt);
+	if (ret) {
+		goto out;
+	}
+
+	/* The root is a leaf, nothing to split */
+	if (STAILQ_EMPTY(&hsrt->wqh)) {
+		ret = hs_gather(hsrt);
+		goto out;
+	}
+
+	ret = -ENOMEM;
+	tb = calloc(1, sizeof(*tb));
+	workers = calloc(thread_num, sizeof(*workers));
+	tids = calloc(thread_num, sizeof(*tids));
+	if (!tb || !workers || !tids) {
+		goto out;
+	}
+
+	tb->thread_num = thread_num;
+	tb->deques = calloc(thread_num, sizeof(*tb->deques));
+	if (!tb->deques) {
+		goto out;
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		pthread_mutex_init(&tb->deques[i].lock, NULL);
+	}
+
+	tb->slabs[0] = malloc(HS_SLAB_NODES * sizeof(*tb->slabs[0]));
+	tb->slab_num = 1;
+	if (!tb->slabs[0]) {
+		goto out;
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		dq = &tb->deques[i];
+		dq->size = 64;
+		dq->ents = malloc(dq->size * sizeof(*dq->ents));
+
+		/* Own trees only for the node, leaf and depth statistics */
+		if (!dq->ents || hs_init(&workers[i], hsrt->part, hsrt->cfg)) {
+			/* hs_init() cleans up after itself */
+			memset(&workers[i], 0, sizeof(workers[i]));
+			goto out;
+		}
+
+		workers[i].cur = hsrt->cur;
+		workers[i].tb = tb;
+		workers[i].worker = i;
+	}
+
+	/* Node 0 of slab 0 is the root, the rest of the slab is worker 0's */
+	workers[0].slab_next = 1;
+	workers[0].slab_end = HS_SLAB_NODES;
+
+	ent = STAILQ_FIRST(&hsrt->wqh);
+	STAILQ_REMOVE_HEAD(&hsrt->wqh, e);
+	ent->node_id = 0;
+	tb->deques[0].ents[tb->deques[0].tail++] = ent;
+	tb->pending = 1;
+
+	for (i = 0; i < thread_num; i++) {
+		if (pthread_create(&tids[i], NULL, hs_tree_worker_run, &workers[i])) {
+			dbg("Cannot start build worker %d", i);
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	if (tb->failed) {
+		goto out;
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		p_tree->inode_num += workers[i].trees[hsrt->cur].inode_num;
+		p_tree->enode_num += workers[i].trees[hsrt->cur].enode_num;
+		if (workers[i].trees[hsrt->cur].depth_max > p_tree->depth_max) {
+			p_tree->depth_max = workers[i].trees[hsrt->cur].depth_max;
+		}
+	}
+
+	nodes = hs_tree_build_gather(hsrt, tb, p_tree->inode_num);
+	if (!nodes) {
+		goto out;
+	}
+
+	dbg("Tree %d: %d nodes from %d slabs of %d workers", hsrt->cur,
+		p_tree->inode_num, tb->slab_num, thread_num);
+
+	/* Hand the packed nodes over as if node_pool had built them */
+	MPOOL_RESET(&hsrt->node_pool);
+	MPOOL_BASE(&hsrt->node_pool) = (typeof(MPOOL_BASE(&hsrt->node_pool)))nodes;
+	MPOOL_SIZE(&hsrt->node_pool) = MPOOL_COUNT(&hsrt->node_pool) =
+		p_tree->inode_num;
+
+	ret = hs_gather(hsrt);
+
+out:
+	if (tb) {
+		for (i = 0; i < thread_num && tb->deques; i++) {
+			dq = &tb->deques[i];
+			while (dq->tail > dq->head) {
+				ent = dq->ents[--dq->tail];
+				free(ent->rule_id);
+				free(ent);
+			}
+
+			free(dq->ents);
+			pthread_mutex_destroy(&dq->lock);
+			hs_scratch_term(&workers[i]);
+			free(workers[i].trees);
+		}
+
+		for (i = 0; i < MIN(tb->slab_num, HS_SLAB_MAX); i++) {
+			free(tb->slabs[i]);
+		}
+
+		free(tb->deques);
+	}
+
+	free(tids);
+	free(workers);
+	free(tb);
+
+	if (ret) {
+		hs_tree_free(p_tree);
+		memset(p_tree, 0, sizeof(*p_tree));
+	}
+
+	return ret;
+}
+
+struct hs_build_worker {
+	struct hs_runtime	hsrt; /* own scratch, trees shared with the others */
+	const int			*order;
+	int					*next; /* next position in order, shared */
+	int					id;
+	int					tree_num;
+	int					rule_num;
+	int					ret;
+	pthread_t			tid;
+};
+
+static void *hs_build_worker_run(void *arg)
+{
+	int i, ret;
+	struct hs_build_worker *w = arg;
+	const struct partition *part = w->hsrt.part;
+
+	while ((i = __atomic_fetch_add(w->next, 1, __ATOMIC_RELAXED)) <
+		   part->subset_num) {
+		w->hsrt.cur = w->order[i];
+
+		ret = hs_build_subset(&w->hsrt);
+		if (ret) {
+			/* Leave the tree to hs_tree_free() empty, stop the others */
+			memset(&w->hsrt.trees[w->hsrt.cur], 0,
+				   sizeof(w->hsrt.trees[w->hsrt.cur]));
+			__atomic_store_n(w->next, part->subset_num, __ATOMIC_RELAXED);
+			w->ret = ret;
+			break;
+		}
+
+		w->tree_num++;
+		w->rule_num += part->subsets[w->hsrt.cur].rule_num;
+	}
+
+	return NULL;
+}
+
+/*
+ * Build the trees of hsrt->trees with thread_num workers. Subsets are taken
+ * largest first, so the longest builds start early and the small ones fill
+ * the gaps at the end. Trees are independent: a worker only needs its own
+ * shadow ranges, pools and queue, and writes nothing but its trees.
+ * A subset with more than its fair share of the rules would still be the
+ * whole build time, so those are built first, one at a time, by all
+ * workers together.
+ */
+static int hs_build_parallel(struct hs_runtime *hsrt, int thread_num)
+{
+	int i, j, ret = 0, next = 0, order[PART_MAX];
+	struct hs_build_worker *workers;
+	const struct partition *part = hsrt->part;
+
+	/* Insertion sort, there are at most PART_MAX subsets */
+	for (i = 0; i < part->subset_num; i++) {
+		for (j = i; j > 0 && part->subsets[order[j - 1]].rule_num <
+			 part->subsets[i].rule_num; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+
+	for (; next < part->subset_num && hs_tree_parallel_ok(hsrt->cfg) &&
+		 (long)part->subsets[order[next]].rule_num * thread_num >
+		 part->rule_num; next++) {
+		hsrt->cur = order[next];
+
+		ret = hs_build_tree_parallel(hsrt, thread_num);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (next == part->subset_num) {
+		return 0;
+	}
+
+	thread_num = MIN(thread_num, part->subset_num - next);
+
+	workers = calloc(thread_num, sizeof(*workers));
+	if (!workers) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		ret = hs_scratch_init(&workers[i].hsrt, part, hsrt->cfg);
+		if (ret) {
+			while (--i >= 0) {
+				hs_scratch_term(&workers[i].hsrt);
+			}
+
+			free(workers);
+			return ret;
+		}
+
+		workers[i].hsrt.trees = hsrt->trees;
+		workers[i].order = order;
+		workers[i].next = &next;
+		workers[i].id = i;
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		if (pthread_create(&workers[i].tid, NULL, hs_build_worker_run,
+						   &workers[i])) {
+			dbg("Cannot start build worker %d", i);
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		pthread_join(workers[i].tid, NULL);
+
+		if (workers[i].ret) {
+			ret = workers[i].ret;
+		}
+
+		dbg("Build worker %d: %d trees, %d rules", i, workers[i].tree_num,
+			workers[i].rule_num);
+		hs_scratch_term(&workers[i].hsrt);
+	}
+
+	free(workers);
+
+	return ret;
+}
+
+//////////////////////////////////////////////////////
+
+int hs_build(void *built_result, const struct partition *part)
+{
+	static const struct hs_config cfg = {
+		.fanout = 2, .binth = 0, .dedup = 0, .exact = NULL, .multi = 0,
+		.counter = NULL, .threads = 0, .jump = 0
+	};
+
+	return hs_build_config(built_result, part, &cfg);
+}
+
+/* Caches of classification results compare it to tell builds apart */
+static uint32_t hs_build_gen;
+
+int hs_build_config(void *built_result, const struct partition *part,
+					const struct hs_config *cfg)
+{
+	int ret;
+	struct hs_runtime hsrt;
+	struct hs_result *hsret;
+
+	if (!built_result || !part || !part->subsets || part->subset_num <= 0 ||
+		part->subset_num > PART_MAX || part->rule_num <= 1) {
+		printf("Cannot build HyperSplit root because of wrong parameters\n");
+		return -EINVAL;
+	}
+
+	if (!cfg || (cfg->fanout != 2 && cfg->fanout != 4 &&
+				 cfg->fanout != HS_KNODE_FANOUT)) {
+		dbg("Unsupported fanout");
+		return -EINVAL;
+	}
+
+	if (cfg->binth < 0 || (cfg->binth && cfg->fanout != 2)) {
+		dbg("Buckets need binary nodes");
+		return -EINVAL;
+	}
+
+	if (cfg->dedup && cfg->fanout != 2) {
+		dbg("Dedup needs binary nodes");
+		return -EINVAL;
+	}
+
+	if (cfg->multi < 0 ||
+		(cfg->multi && (cfg->fanout != 2 || cfg->binth || cfg->exact))) {
+		dbg("Multi-match needs binary nodes and every rule in the trees");
+		return -EINVAL;
+	}
+
+#ifdef ENABLE_COMPACT_NODE
+	/* compact trees are encoded depth first, one slot per visit */
+	if (cfg->dedup) {
+		dbg("Dedup does not support compact nodes");
+		return -EINVAL;
+	}
+#endif
+
+	/* Init */
+	ret = hs_init(&hsrt, part, cfg);
+	if (ret) {
+		return ret;
+	}
+
+	/* Build hypersplit tree for each subset */
+	if (cfg->threads > 1) {
+		ret = hs_build_parallel(&hsrt, cfg->threads);
+		if (ret) {
+			/* Every tree is either built or left empty */
+			hsrt.cur = part->subset_num;
+			goto err;
+		}
+	}
+	else {
+		for (hsrt.cur = 0; hsrt.cur < part->subset_num; hsrt.cur++) {
+			ret = hs_build_subset(&hsrt);
+			if (ret) {
+				goto err;
+			}
+		}
+	}
+
+	{
+		int node_num = 0, depth_max = 0;
+		size_t node_size = cfg->fanout > 2 ? sizeof(struct hs_knode) :
+							sizeof(struct hs_node);
+
+		for (hsrt.cur = 0; hsrt.cur < part->subset_num; hsrt.cur++) {
+			node_num += hsrt.trees[hsrt.cur].node_num;
+			if (hsrt.trees[hsrt.cur].depth_max > depth_max) {
+				depth_max = hsrt.trees[hsrt.cur].depth_max;
+			}
+		}
+
+		dbg("Nodes: %d, fanout %d, Depth max=%d, Mem=%zu Bytes",
+			node_num, cfg->fanout, depth_max, node_num * node_size);
+	}
+
+	if (cfg->binth) {
+		int bucket_num = 0, block_num = 0;
+
+		for (hsrt.cur = 0; hsrt.cur < part->subset_num; hsrt.cur++) {
+			bucket_num += hsrt.trees[hsrt.cur].bucket_num;
+			block_num += hsrt.trees[hsrt.cur].block_num;
+		}
+
+		dbg("Buckets: %d with binth %d, %d blocks, Mem=%zu Bytes",
+			bucket_num, cfg->binth, block_num,
+			block_num * sizeof(struct hs_bucket_block) +
+			bucket_num * sizeof(struct hs_bucket));
+	}
+
+	if (cfg->multi) {
+		int list_num = 0, list_max = 0;
+		size_t list_mem = 0;
+
+		for (hsrt.cur = 0; hsrt.cur < part->subset_num; hsrt.cur++) {
+			struct hs_tree *p_tree = &hsrt.trees[hsrt.cur];
+
+			list_num += p_tree->list_num;
+			list_mem += p_tree->list_offs[p_tree->list_num] +
+						(p_tree->list_num + 1) * sizeof(*p_tree->list_offs);
+			if (p_tree->list_max > list_max) {
+				list_max = p_tree->list_max;
+			}
+		}
+
+		dbg("Lists: %d, longest %d rules, Mem=%zu Bytes",
+			list_num, list_max, list_mem);
+	}
+
+	{
+		int jump_num = 0;
+		size_t jump_mem = 0;
+
+		for (hsrt.cur = 0; hsrt.cur < part->subset_num; hsrt.cur++) {
+			if (hsrt.trees[hsrt.cur].jump) {
+				jump_num++;
+				jump_mem += sizeof(uint32_t) << hsrt.trees[hsrt.cur].jump_bits;
+			}
+		}
+
+		dbg("Jump tables: %d of %d trees, Mem=%zu Bytes",
+			jump_num, part->subset_num, jump_mem);
+	}
+
+#ifdef ENABLE_COMPACT_NODE
+	{
+		int cnode_num = 0, wnode_num = 0, node_num = 0;
+
+		for (hsrt.cur = 0; hsrt.cur < part->subset_num; hsrt.cur++) {
+			cnode_num += hsrt.trees[hsrt.cur].cnode_num;
+			wnode_num += hsrt.trees[hsrt.cur].wnode_num;
+			node_num += hsrt.trees[hsrt.cur].node_num;
+		}
+
+		dbg("Compact nodes: %d (%d wide), Mem=%zu Bytes, Wide Mem=%zu Bytes",
+			cnode_num, wnode_num,
+			cnode_num * sizeof(struct hs_cnode) +
+			wnode_num * sizeof(struct hs_node),
+			node_num * sizeof(struct hs_node));
+	}
+#endif
+
+	/* Write final result */
+	hsret = malloc(sizeof(*hsret));
+	if (!hsret) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	/*
+	 * Searches visit trees in ascending order of pri_min and stop once
+	 * the best priority found beats the next tree's bound
+	 */
+	qsort(hsrt.trees, part->subset_num, sizeof(*hsrt.trees), hs_tree_pri_cmp);
+
+	hsret->trees = hsrt.trees;
+	hsrt.trees = NULL;
+	hsret->tree_num = part->subset_num;
+	hsret->def_rule = part->subsets[0].def_rule;
+	hsret->gen = ++hs_build_gen;
+	hsret->exact = cfg->exact;
+	hsret->counter = cfg->counter;
+	hsret->multi = cfg->multi;
+	hsret->region = NULL;
+	hsret->region_size = 0;
+	*(typeof(hsret) *)built_result = hsret;
+
+	/* Term */
+	hs_terminate(&hsrt);
+
+	//printf("Depth AVG: %g \n", hsret->trees->depth_avg);
+
+	return 0;
+
+err:
+	while (--hsrt.cur >= 0) {
+		hs_tree_free(&hsrt.trees[hsrt.cur]);
+	}
+
+	hs_terminate(&hsrt);
+
+	return ret;
+}
+
+int hs_search(const struct trace *trace, const void *built_result)
+{
+	int i;
+	const struct hs_result *hsret;
+
+	if (!trace || !trace->pkts || !built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	/* For each packet */
+	for (i = 0; i < trace->pkt_num; i++) {
+		trace->pkts[i].found = hs_search_pkt(hsret, &trace->pkts[i]);
+		counter_hit(hsret->counter, trace->pkts[i].found);
+	}
+
+	return 0;
+}
+
+/* Number of thresholds below value, i.e. the child to descend into */
+static inline int hs_knode_child(const struct hs_knode *p_knode, uint32_t value)
+{
+#if defined(__SSE2__)
+	const __m128i bias = _mm_set1_epi32(INT32_MIN);
+	const __m128i key = _mm_xor_si128(_mm_set1_epi32(value), bias);
+	const __m128i *thr = (const __m128i *)p_knode->thresholds;
+	int mask;
+
+	/* unsigned compare through the sign bit; lane 7 is the dim */
+	mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(
+				key, _mm_xor_si128(_mm_load_si128(thr), bias))));
+	mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(
+				key, _mm_xor_si128(_mm_load_si128(thr + 1), bias)))) << 4;
+
+	/*
+	 * Thresholds ascend, so the set lanes are a prefix and their count is
+	 * the first clear lane: ctz needs no popcnt support
+	 */
+	return __builtin_ctz(~mask | (1 << (HS_KNODE_FANOUT - 1)));
+#else
+	int i, child = 0;
+
+	for (i = 0; i < HS_KNODE_FANOUT - 1; i++) {
+		child += value > p_knode->thresholds[i];
+	}
+
+	return child;
+#endif
+}
+
+/* hs_search() for trees built with a fanout above 2 */
+int hs_search_kary(const struct trace *trace, const void *built_result)
+{
+	int i, j, pri;
+	register uint32_t id, offset;
+	register const struct hs_knode *p_knode, *knodes;
+	const struct packet *p_pkt;
+	const struct hs_result *hsret;
+
+	if (!trace || !trace->pkts || !built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees || !hsret->trees[0].knodes) {
+		return -EINVAL;
+	}
+
+	offset = hsret->def_rule + 1;
+
+	/* For each packet */
+	for (i = 0; i < trace->pkt_num; i++) {
+		p_pkt = &trace->pkts[i];
+		pri = hsret->def_rule;
+
+		/* For each tree, in ascending order of pri_min */
+		for (j = 0; j < hsret->tree_num; j++) {
+			if (pri < hsret->trees[j].pri_min) {
+				break;
+			}
+
+			/* For each node */
+			id = offset;
+			knodes = hsret->trees[j].knodes;
+
+			do {
+				p_knode = knodes + id - offset;
+				id = p_knode->children[hs_knode_child(p_knode,
+										p_pkt->dims[p_knode->dim])];
+			} while (id >= offset);
+
+			if (id < pri) {
+				pri = id;
+			}
+		}
+
+		trace->pkts[i].found = pri;
+		counter_hit(hsret->counter, pri);
+	}
+
+	return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int hs_bucket_scan_avx2(const struct hs_bucket_block *p_block,
+							   int block_num, const struct packet *p_pkt)
+{
+	int d, mask;
+	__m256i val, match;
+
+	for (; block_num > 0; block_num--, p_block++) {
+		match = _mm256_set1_epi32(-1);
+
+		/* unsigned lo <= val <= hi on every dimension */
+		for (d = 0; d < DIM_MAX; d++) {
+			val = _mm256_set1_epi32(p_pkt->dims[d]);
+			match = _mm256_and_si256(match, _mm256_cmpeq_epi32(val,
+						_mm256_max_epu32(val, _mm256_loadu_si256(
+							(const __m256i *)p_block->lo[d]))));
+			match = _mm256_and_si256(match, _mm256_cmpeq_epi32(val,
+						_mm256_min_epu32(val, _mm256_loadu_si256(
+							(const __m256i *)p_block->hi[d]))));
+		}
+
+		/* lanes ascend in priority: the first match is the best */
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+		if (mask) {
+			return p_block->pri[__builtin_ctz(mask)];
+		}
+	}
+
+	return INT_MAX;
+}
+#endif
+
+static int hs_bucket_scan(const struct hs_bucket_block *p_block,
+						  int block_num, const struct packet *p_pkt)
+{
+	int d, j;
+
+	for (; block_num > 0; block_num--, p_block++) {
+		for (j = 0; j < HS_BUCKET_LANES; j++) {
+			for (d = 0; d < DIM_MAX; d++) {
+				if (p_pkt->dims[d] < p_block->lo[d][j] ||
+					p_pkt->dims[d] > p_block->hi[d][j]) {
+					break;
+				}
+			}
+
+			if (d == DIM_MAX) {
+				return p_block->pri[j];
+			}
+		}
+	}
+
+	return INT_MAX;
+}
+
+/* hs_search() for trees built with binth, whose leaves can be buckets */
+int hs_search_binth(const struct trace *trace, const void *built_result)
+{
+	int i, j, pri;
+	register uint32_t id, offset;
+	register const struct hs_node *p_node, *root_node;
+	const struct hs_tree *p_tree;
+	const struct hs_bucket *p_bkt;
+	const struct packet *p_pkt;
+	const struct hs_result *hsret;
+	int (*scan)(const struct hs_bucket_block *, int, const struct packet *);
+
+	if (!trace || !trace->pkts || !built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	scan = hs_bucket_scan;
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan = hs_bucket_scan_avx2;
+	}
+#endif
+
+	offset = hsret->def_rule + 1;
+
+	/* For each packet */
+	for (i = 0; i < trace->pkt_num; i++) {
+		p_pkt = &trace->pkts[i];
+		pri = hsret->def_rule;
+
+		/* For each tree, in ascending order of pri_min */
+		for (j = 0; j < hsret->tree_num; j++) {
+			p_tree = &hsret->trees[j];
+			if (pri < p_tree->pri_min) {
+				break;
+			}
+
+			/* For each node */
+			id = offset;
+			root_node = p_tree->root_node;
+
+			do {
+				p_node = root_node + id - offset;
+
+				if (p_pkt->dims[p_node->dim] <= p_node->threshold) {
+					id = p_node->lchild;
+				}
+				else {
+					id = p_node->rchild;
+				}
+			} while (id >= offset && !(id & HS_BUCKET_FLAG));
+
+			if (id & HS_BUCKET_FLAG) {
+				p_bkt = &p_tree->buckets[id & ~HS_BUCKET_FLAG];
+
+				/* the first lane is the best the bucket can return */
+				if (p_tree->blocks[p_bkt->block].pri[0] >= pri) {
+					continue;
+				}
+
+				id = scan(&p_tree->blocks[p_bkt->block], p_bkt->block_num,
+						  p_pkt);
+			}
+
+			if ((int)id < pri) {
+				pri = id;
+			}
+		}
+
+		trace->pkts[i].found = pri;
+		counter_hit(hsret->counter, pri);
+	}
+
+	return 0;
+}
+
+/*
+ * Same result as hs_search(), but a group of packets walks each tree in
+ * lockstep: every round advances all lanes in flight by one level and
+ * prefetches their next nodes, so the cache misses of independent lookups
+ * overlap instead of being paid one after another. Lanes stay in place,
+ * a finished one only sets its bit in done.
+ */
+int hs_search_batch(const struct trace *trace, const void *built_result)
+{
+	int i, j, k, lane_num, pri[HS_BATCH_SIZE];
+	uint32_t id[HS_BATCH_SIZE], offset, done, all, lchild, rchild, right;
+	const struct hs_result *hsret;
+	const struct packet *pkts;
+	const struct hs_node *p_node, *root_node;
+
+	if (!trace || !trace->pkts || !built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	offset = hsret->def_rule + 1;
+
+	/* For each group of packets */
+	for (i = 0; i < trace->pkt_num; i += HS_BATCH_SIZE) {
+		pkts = &trace->pkts[i];
+		lane_num = MIN(HS_BATCH_SIZE, trace->pkt_num - i);
+		all = (1U << lane_num) - 1;
+
+		/* Exact-match hits first, they end the tree walks early */
+		for (k = 0; k < lane_num; k++) {
+			pri[k] = hsret->def_rule;
+			if (hsret->exact) {
+				pri[k] = hs_exact_search_pkt(hsret->exact, &pkts[k], pri[k]);
+			}
+		}
+
+		/* For each tree, until no lane can improve */
+		for (j = 0; j < hsret->tree_num; j++) {
+			root_node = hsret->trees[j].root_node;
+			__builtin_prefetch(root_node);
+
+			/* Lanes that cannot improve skip the tree */
+			for (done = k = 0; k < lane_num; k++) {
+				id[k] = offset;
+				done |= (uint32_t)(pri[k] < hsret->trees[j].pri_min) << k;
+			}
+
+			if (done == all) {
+				break;
+			}
+
+			/* One level per round for every lane still in flight */
+			while (done != all) {
+				for (k = 0; k < lane_num; k++) {
+					if (done & 1U << k) {
+						continue;
+					}
+
+					p_node = root_node + id[k] - offset;
+					lchild = p_node->lchild;
+					rchild = p_node->rchild;
+
+					/* Select the child without a branch to mispredict */
+					right = -(uint32_t)(pkts[k].dims[p_node->dim] >
+										p_node->threshold);
+					id[k] = lchild ^ ((lchild ^ rchild) & right);
+
+					if (id[k] >= offset) {
+						__builtin_prefetch(root_node + id[k] - offset);
+					}
+					else {
+						done |= 1U << k;
+					}
+				}
+			}
+
+			for (k = 0; k < lane_num; k++) {
+				if ((int)id[k] < pri[k]) {
+					pri[k] = id[k];
+				}
+			}
+		}
+
+		for (k = 0; k < lane_num; k++) {
+			trace->pkts[i + k].found = pri[k];
+			counter_hit(hsret->counter, pri[k]);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Same result as hs_search_pkt(), but the packet walks a window of trees
+ * in lockstep: every round advances each tree in the window by one level
+ * and prefetches its next node, so the cache misses of the walks of a
+ * single packet overlap. A finished walk hands its slot to the next tree,
+ * in ascending order of pri_min, and trees whose pri_min cannot beat the
+ * best rule found so far are never entered or drop out, as hs_search_pkt()
+ * skips them.
+ */
+int hs_search_pkt_interleave(const struct hs_result *hsret,
+							 const struct packet *p_pkt)
+{
+	int k, next, lane_num, pri = hsret->def_rule;
+	int pri_min[HS_INTERLEAVE_WAYS];
+	uint32_t id[HS_INTERLEAVE_WAYS], offset = hsret->def_rule + 1;
+	uint32_t lchild, rchild, right;
+	const struct hs_node *root[HS_INTERLEAVE_WAYS], *p_node;
+	const struct hs_tree *trees = hsret->trees;
+
+	if (hsret->exact) {
+		pri = hs_exact_search_pkt(hsret->exact, p_pkt, pri);
+	}
+
+	for (next = lane_num = 0; lane_num < HS_INTERLEAVE_WAYS &&
+		 next < hsret->tree_num && pri >= trees[next].pri_min; next++) {
+		__builtin_prefetch(trees[next].root_node);
+		root[lane_num] = trees[next].root_node;
+		pri_min[lane_num] = trees[next].pri_min;
+		id[lane_num++] = offset;
+	}
+
+	/* One level per round for every tree in the window */
+	while (lane_num > 0) {
+		for (k = 0; k < lane_num; k++) {
+			if (pri >= pri_min[k]) {
+				p_node = root[k] + id[k] - offset;
+				lchild = p_node->lchild;
+				rchild = p_node->rchild;
+
+				/* Select the child without a branch to mispredict */
+				right = -(uint32_t)(p_pkt->dims[p_node->dim] >
+									p_node->threshold);
+				id[k] = lchild ^ ((lchild ^ rchild) & right);
+
+				if (id[k] >= offset) {
+					__builtin_prefetch(root[k] + id[k] - offset);
+					continue;
+				}
+
+				if ((int)id[k] < pri) {
+					pri = id[k];
+				}
+			}
+
+			/* The slot goes to the next tree that can still improve */
+			if (next < hsret->tree_num && pri >= trees[next].pri_min) {
+				__builtin_prefetch(trees[next].root_node);
+				root[k] = trees[next].root_node;
+				pri_min[k] = trees[next++].pri_min;
+				id[k] = offset;
+			}
+			else {
+				lane_num--;
+				root[k] = root[lane_num];
+				pri_min[k] = pri_min[lane_num];
+				id[k--] = id[lane_num];
+			}
+		}
+	}
+
+	return pri;
+}
+
+int hs_search_interleave(const struct trace *trace, const void *built_result)
+{
+	int i;
+	const struct hs_result *hsret;
+
+	if (!trace || !trace->pkts || !built_result) {
+		return -EINVAL;
+	}
+
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	/* For each packet, on its own */
+	for (i = 0; i < trace->pkt_num; i++) {
+		trace->pkts[i].found = hs_search_pkt_interleave(hsret,
+														&trace->pkts[i]);
+		counter_hit(hsret->counter, trace->pkts[i].found);
 	}
 
 	return 0;
+}
 
-err:
-	if (!is_inplace) {
-		free(new_rule_id);
+/*
+ * Same result as hs_search(), but each tree walk starts from the entry of
+ * its root jump table selected by the packet, skipping the top levels.
+ */
+int hs_search_jump(const struct trace *trace, const void *built_result)
+{
+	int i, j, pri;
+	const struct hs_result *hsret;
+	const struct hs_tree *p_tree;
+
+	register uint32_t id, offset;
+	register const struct packet *p_pkt;
+	register const struct hs_node *p_node, *root_node;
+
+	if (!trace || !trace->pkts || !built_result) {
+		return -EINVAL;
 	}
 
-	return -ENOMEM;
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees) {
+		return -EINVAL;
+	}
+
+	offset = hsret->def_rule + 1;
+
+	/* For each packet */
+	for (i = 0; i < trace->pkt_num; i++) {
+		pri = hsret->def_rule;
+		p_pkt = &trace->pkts[i];
+
+		/* For each tree, in ascending order of pri_min */
+		for (j = 0; j < hsret->tree_num; j++) {
+			p_tree = &hsret->trees[j];
+			if (pri < p_tree->pri_min) {
+				break;
+			}
+
+			root_node = p_tree->root_node;
+
+			if (p_tree->jump) {
+				id = p_tree->jump[p_pkt->dims[p_tree->jump_dim] >>
+								  p_tree->jump_shift];
+			}
+			else {
+				id = offset;
+			}
+
+			/* For each remaining node */
+			while (id >= offset) {
+				p_node = root_node + id - offset;
+
+				if (p_pkt->dims[p_node->dim] <= p_node->threshold) {
+					id = p_node->lchild;
+				}
+				else {
+					id = p_node->rchild;
+				}
+			}
+
+			if (id < pri) {
+				pri = id;
+			}
+		}
+
+		trace->pkts[i].found = pri;
+		counter_hit(hsret->counter, pri);
+	}
+
+	return 0;
 }
 
-static int hs_space_is_fully_covered(uint32_t (*left)[2], uint32_t (*right)[2])
+/*
+ * Pack the nodes into cache line blocks of HS_BLOCK_SLOTS slots. A block is
+ * filled breadth first from its root, so with four slots it holds a node,
+ * both children and the first grandchild. A node whose children are both
+ * leaves is not worth a block of its own: such nodes share a block with up
+ * to HS_BLOCK_SLOTS - 1 others. A node id is then the block index plus the
+ * in-block slot, (block * HS_BLOCK_SLOTS + slot), so hs_search() and the
+ * other kernels walk the blocked array unchanged, with one cache miss per
+ * block instead of one per level.
+ */
+int hs_relayout_blocked(void *built_result)
 {
-	int i;
+	int i, j, top, block_num, lone_block, lone_slot, ret = 0;
+	size_t slot_sum = 0;
+	uint32_t root, offset, *new_id, *stack;
+	struct hs_result *hsret;
+	struct hs_tree *p_tree;
+	const struct hs_node *p_node;
 
-	//assert(left && right);
+	if (!built_result) {
+		return -EINVAL;
+	}
 
-	if (left == NULL || right == NULL) {
-		return 0;
+	hsret = *(typeof(hsret) *)built_result;
+	/* The arrays of a clone cannot be reallocated */
+	if (!hsret || !hsret->trees || hsret->region) {
+		return -EINVAL;
 	}
 
-	for (i = 0; i < DIM_MAX; i++) {
-		/* left is fully covered by right */
-		if (left[i][0] < right[i][0] || left[i][1] > right[i][1]) {
-			return 0;
+	offset = hsret->def_rule + 1;
+
+	for (j = 0; j < hsret->tree_num; j++) {
+		p_tree = &hsret->trees[j];
+
+		/* a shared node cannot be placed twice */
+		if (p_tree->dag) {
+			return -EINVAL;
+		}
+
+		new_id = malloc(p_tree->node_num * sizeof(*new_id));
+		stack = malloc(p_tree->node_num * sizeof(*stack));
+		if (!new_id || !stack) {
+			free(stack);
+			free(new_id);
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < p_tree->node_num; i++) {
+			new_id[i] = UINT32_MAX;
+		}
+
+		/* Depth first over block roots, so sibling blocks stay close */
+		block_num = top = 0;
+		lone_block = -1;
+		lone_slot = HS_BLOCK_SLOTS;
+		stack[top++] = 0;
+
+		while (top > 0) {
+			/* a full block leaves at most HS_BLOCK_SLOTS + 1 children out */
+			uint32_t slot_node[HS_BLOCK_SLOTS], child[HS_BLOCK_SLOTS + 1];
+			uint32_t kid[2];
+			int slot_num = 1, child_num = 0, block = block_num++, k, n;
+
+			root = stack[--top];
+			slot_node[0] = root;
+
+			for (k = 0; k < slot_num; k++) {
+				p_node = &p_tree->root_node[slot_node[k]];
+				new_id[slot_node[k]] = block * HS_BLOCK_SLOTS + k;
+
+				kid[0] = p_node->lchild;
+				kid[1] = p_node->rchild;
+
+				for (n = 0; n < 2; n++) {
+					if (kid[n] < offset) {
+						continue;
+					}
+
+					if (slot_num < HS_BLOCK_SLOTS) {
+						slot_node[slot_num++] = kid[n] - offset;
+					}
+					else {
+						child[child_num++] = kid[n] - offset;
+					}
+				}
+			}
+
+			/* the leftmost child block is laid out next */
+			while (child_num > 0) {
+				root = child[--child_num];
+				p_node = &p_tree->root_node[root];
+
+				if (p_node->lchild >= offset || p_node->rchild >= offset) {
+					stack[top++] = root;
+					continue;
+				}
+
+				if (lone_slot == HS_BLOCK_SLOTS) {
+					lone_block = block_num++;
+					lone_slot = 0;
+				}
+
+				new_id[root] = lone_block * HS_BLOCK_SLOTS + lone_slot++;
+			}
+		}
+
+		ret = hs_tree_remap(p_tree, new_id, block_num * HS_BLOCK_SLOTS,
+							offset);
+
+		free(stack);
+		free(new_id);
+
+		if (ret) {
+			return ret;
 		}
+
+		slot_sum += block_num * HS_BLOCK_SLOTS;
 	}
 
-	return 1;
-}
+	dbg("Blocks: %zu, Mem=%zu Bytes", slot_sum / HS_BLOCK_SLOTS,
+		slot_sum * sizeof(struct hs_node));
 
-//////////////////////////////////////////////////////
+	return 0;
+}
 
-int hs_build(void *built_result, const struct partition *part)
+/*
+ * Profile guided renumbering: run the training trace through every tree,
+ * count the visits of each node, then lay the nodes out depth first taking
+ * the hotter child first, so the hottest root-to-leaf paths are contiguous.
+ * Subtrees never visited by the trace are moved to the end of the array.
+ */
+int hs_reorder(void *built_result, const struct trace *trace)
 {
-	int ret;
-	struct hs_runtime hsrt;
+	int i, j, k, top, cold_num, new_num, ret;
+	uint32_t id, offset, hot, cold, *cnts, *new_id, *stack, *colds;
 	struct hs_result *hsret;
+	struct hs_tree *p_tree;
+	const struct hs_node *p_node;
 
-	if (!built_result || !part || !part->subsets || part->subset_num <= 0 ||
-		part->subset_num > PART_MAX || part->rule_num <= 1) {
-		printf("Cannot build HyperSplit root because of wrong parameters\n");
+	if (!built_result || !trace || !trace->pkts) {
 		return -EINVAL;
 	}
 
-	/* Init */
-	ret = hs_init(&hsrt, part);
-	if (ret) {
-		return ret;
+	hsret = *(typeof(hsret) *)built_result;
+	/* The arrays of a clone cannot be reallocated */
+	if (!hsret || !hsret->trees || hsret->region) {
+		return -EINVAL;
 	}
 
-	/* Build hypersplit tree for each subset */
-	for (hsrt.cur = 0; hsrt.cur < part->subset_num; hsrt.cur++) {
-		/* trigger entry enqueue */
-		ret = hs_trigger(&hsrt);
-		if (ret) {
-			goto err;
+	offset = hsret->def_rule + 1;
+
+	for (j = 0; j < hsret->tree_num; j++) {
+		p_tree = &hsret->trees[j];
+
+		/* a shared node cannot be placed twice */
+		if (p_tree->dag) {
+			return -EINVAL;
 		}
 
-		/* hypersplit building */
-		ret = hs_process(&hsrt);
-		if (ret) {
+		cnts = calloc(p_tree->node_num, sizeof(*cnts));
+		new_id = malloc(p_tree->node_num * sizeof(*new_id));
+		stack = malloc(p_tree->node_num * sizeof(*stack));
+		colds = malloc(p_tree->node_num * sizeof(*colds));
+		if (!cnts || !new_id || !stack || !colds) {
+			ret = -ENOMEM;
 			goto err;
 		}
 
-		/* write subset result */
-		ret = hs_gather(&hsrt);
+		/* Count node visits */
+		for (i = 0; i < trace->pkt_num; i++) {
+			id = offset;
+
+			do {
+				cnts[id - offset]++;
+				p_node = p_tree->root_node + id - offset;
+
+				if (trace->pkts[i].dims[p_node->dim] <= p_node->threshold) {
+					id = p_node->lchild;
+				}
+				else {
+					id = p_node->rchild;
+				}
+			} while (id >= offset);
+		}
+
+		for (i = 0; i < p_tree->node_num; i++) {
+			new_id[i] = UINT32_MAX;
+		}
+
+		/* Hot nodes first, hotter child first; cold subtrees deferred */
+		new_num = top = cold_num = 0;
+		stack[top++] = 0;
+
+		while (top > 0) {
+			i = stack[--top];
+			new_id[i] = new_num++;
+			p_node = &p_tree->root_node[i];
+
+			hot = p_node->lchild, cold = p_node->rchild;
+			if (cold >= offset &&
+				(hot < offset || cnts[cold - offset] > cnts[hot - offset])) {
+				SWAP(hot, cold);
+			}
+
+			if (cold >= offset) {
+				if (cnts[cold - offset]) {
+					stack[top++] = cold - offset;
+				}
+				else {
+					colds[cold_num++] = cold - offset;
+				}
+			}
+
+			if (hot >= offset) {
+				if (cnts[hot - offset]) {
+					stack[top++] = hot - offset;
+				}
+				else {
+					colds[cold_num++] = hot - offset;
+				}
+			}
+		}
+
+		/* Never visited subtrees, plain depth first */
+		for (k = 0; k < cold_num; k++) {
+			stack[top++] = colds[k];
+
+			while (top > 0) {
+				i = stack[--top];
+				new_id[i] = new_num++;
+				p_node = &p_tree->root_node[i];
+
+				if (p_node->rchild >= offset) {
+					stack[top++] = p_node->rchild - offset;
+				}
+
+				if (p_node->lchild >= offset) {
+					stack[top++] = p_node->lchild - offset;
+				}
+			}
+		}
+
+		ret = hs_tree_remap(p_tree, new_id, new_num, offset);
 		if (ret) {
 			goto err;
 		}
-	}
 
-	/* Write final result */
-	hsret = malloc(sizeof(*hsret));
-	if (!hsret) {
-		ret = -ENOMEM;
-		goto err;
+		free(colds);
+		free(stack);
+		free(new_id);
+		free(cnts);
 	}
 
-	hsret->trees = hsrt.trees;
-	hsrt.trees = NULL;
-	hsret->tree_num = part->subset_num;
-	hsret->def_rule = part->subsets[0].def_rule;
-	*(typeof(hsret) *)built_result = hsret;
+	return 0;
 
-	/* Term */
-	hs_terminate(&hsrt);
+err:
+	free(colds);
+	free(stack);
+	free(new_id);
+	free(cnts);
 
-	//printf("Depth AVG: %g \n", hsret->trees->depth_avg);
+	return ret;
+}
 
-	return 0;
+/* Entries per packet hs_search_multi() may return, -EINVAL on error */
+int hs_multi_max(const void *built_result)
+{
+	int j, sum = 0;
+	const struct hs_result *hsret;
 
-err:
-	while (--hsrt.cur >= 0) {
-		free(hsrt.trees[hsrt.cur].root_node);
+	if (!built_result) {
+		return -EINVAL;
 	}
 
-	hs_terminate(&hsrt);
+	hsret = *(typeof(hsret) *)built_result;
+	if (!hsret || !hsret->trees || !hsret->multi) {
+		return -EINVAL;
+	}
 
-	return ret;
+	for (j = 0; j < hsret->tree_num; j++) {
+		sum += hsret->trees[j].list_max;
+	}
+
+	return sum < hsret->multi ? sum : hsret->multi;
 }
 
-int hs_search(const struct trace *trace, const void *built_result)
+/*
+ * Every packet gets the best matching rules, up to hsret->multi, in
+ * matches[i * hs_multi_max()] onwards in ascending priority, and their
+ * number in match_nums[i]. pkt->found is set to the best of them as with
+ * hs_search(). The trees are skipped once the list is full and cannot
+ * improve, so walks stop as early as the single-match search does.
+ */
+int hs_search_multi(const struct trace *trace, const void *built_result,
+					int *matches, int *match_nums)
 {
-	int i, j, pri;
+	int i, j, l, k, num, cnt, list_num;
+	int *best;
+	uint32_t id, pri, offset;
+	const uint8_t *p;
+	const struct hs_node *p_node, *root_node;
+	const struct hs_tree *p_tree;
 	const struct hs_result *hsret;
+	const struct packet *p_pkt;
 
-	register uint32_t id, offset;
-	register const struct packet *p_pkt;
-	register const struct hs_node *p_node, *root_node;
-
-	if (!trace || !trace->pkts || !built_result) {
+	if (!trace || !trace->pkts || !matches || !match_nums) {
 		return -EINVAL;
 	}
 
-	hsret = *(typeof(hsret) *)built_result;
-	if (!hsret || !hsret->trees) {
+	k = hs_multi_max(built_result);
+	if (k <= 0) {
 		return -EINVAL;
 	}
 
-	/* For each packet */
+	hsret = *(typeof(hsret) *)built_result;
 	offset = hsret->def_rule + 1;
 
+	/* For each packet */
 	for (i = 0; i < trace->pkt_num; i++) {
-		/* For each tree */
-		pri = hsret->def_rule;
 		p_pkt = &trace->pkts[i];
+		best = matches + (size_t)i * k;
+		num = 0;
 
-		//printf("Start Search: %d \n", i);
+		/* For each tree, in ascending order of pri_min */
 		for (j = 0; j < hsret->tree_num; j++) {
-			/* For each node */
+			p_tree = &hsret->trees[j];
+			if (num == k && best[k - 1] <= p_tree->pri_min) {
+				break;
+			}
+
+			/* For each node, every leaf is a list */
 			id = offset;
-			root_node = hsret->trees[j].root_node;
+			root_node = p_tree->root_node;
 
 			do {
 				p_node = root_node + id - offset;
 
-				//id = p_pkt->dims[p_node->dim] <= p_node->threshold ?
-				//	 p_node->lchild : p_node->rchild;
-
 				if (p_pkt->dims[p_node->dim] <= p_node->threshold) {
 					id = p_node->lchild;
 				}
 				else {
 					id = p_node->rchild;
 				}
+			} while (!(id & HS_BUCKET_FLAG));
 
-#if 0
-				printf("%d: dim=%d, id=%d, offset=%d, pack=%d \n",
-					   j, p_node->dim, id, offset, p_node->pack);
-#endif
+			id &= ~HS_BUCKET_FLAG;
+			p = p_tree->lists + p_tree->list_offs[id];
+			list_num = hs_varint_get(&p);
 
-				} while (id >= offset);
+			/* Merge the list in, both are in ascending priority */
+			for (pri = 0, cnt = 0; cnt < list_num; cnt++) {
+				pri += hs_varint_get(&p);
 
-			if (id < pri) {
-				pri = id;
+				if (num == k && (int)pri >= best[k - 1]) {
+					break;
+				}
+
+				for (l = num; l > 0 && best[l - 1] > (int)pri; l--);
+
+				/* Rules such as the default one may be in several trees */
+				if (l > 0 && best[l - 1] == (int)pri) {
+					continue;
+				}
+
+				if (num < k) {
+					num++;
+				}
+
+				memmove(&best[l + 1], &best[l],
+						(num - 1 - l) * sizeof(*best));
+				best[l] = pri;
 			}
 		}
 
-		trace->pkts[i].found = pri;
+		match_nums[i] = num;
+		trace->pkts[i].found = num ? best[0] : hsret->def_rule;
+		counter_hit(hsret->counter, trace->pkts[i].found);
 	}
 
 	return 0;
 }
 
+#define HS_CLONE_ALIGN(size) \
+	(((size) + HS_CACHE_LINE - 1) & ~(size_t)(HS_CACHE_LINE - 1))
+
+/*
+ * Copy the arrays of src to base + offset onwards, or only count their
+ * size if base is NULL. Return the offset past the last array.
+ */
+static size_t hs_clone_tree(struct hs_tree *dst, const struct hs_tree *src,
+							char *base, size_t offset)
+{
+#define HS_CLONE_ARRAY(field, num) \
+	do { \
+		size_t size = (size_t)(num) * sizeof(*src->field); \
+		if (src->field && base) { \
+			dst->field = (void *)(base + offset); \
+			memcpy(dst->field, src->field, size); \
+		} \
+		offset += src->field ? HS_CLONE_ALIGN(size) : 0; \
+	} while (0)
+
+	HS_CLONE_ARRAY(root_node, src->node_num);
+	HS_CLONE_ARRAY(knodes, src->node_num);
+	HS_CLONE_ARRAY(buckets, src->bucket_num);
+	HS_CLONE_ARRAY(blocks, src->block_num);
+	HS_CLONE_ARRAY(lists, src->list_offs ? src->list_offs[src->list_num] : 0);
+	HS_CLONE_ARRAY(list_offs, src->list_num + 1);
+	HS_CLONE_ARRAY(jump, 1 << src->jump_bits);
+#ifdef ENABLE_COMPACT_NODE
+	HS_CLONE_ARRAY(cnodes, src->cnode_num);
+	HS_CLONE_ARRAY(wnodes, src->wnode_num);
+#endif
+
+#undef HS_CLONE_ARRAY
+
+	return offset;
+}
+
+/*
+ * Copy a built forest into a single block from alloc, every array on a
+ * cache line of its own. The copy searches as the original, hs_destroy()
+ * gives the block back to alloc. Exact-match tables and hit counters are
+ * shared with src_result, not copied.
+ */
+int hs_clone(void *dst_result, const void *src_result,
+			 const struct hs_alloc *alloc)
+{
+	int j;
+	size_t size;
+	char *base;
+	struct hs_result *dst;
+	const struct hs_result *src;
+
+	if (!dst_result || !src_result || !alloc || !alloc->alloc ||
+		!alloc->free) {
+		return -EINVAL;
+	}
+
+	src = *(typeof(src) *)src_result;
+	if (!src || !src->trees) {
+		return -EINVAL;
+	}
+
+	size = HS_CLONE_ALIGN(sizeof(*src)) +
+		   HS_CLONE_ALIGN(src->tree_num * sizeof(*src->trees));
+	for (j = 0; j < src->tree_num; j++) {
+		size = hs_clone_tree(NULL, &src->trees[j], NULL, size);
+	}
+
+	base = alloc->alloc(size, alloc->arg);
+	if (!base) {
+		return -ENOMEM;
+	}
+
+	dst = (struct hs_result *)base;
+	*dst = *src;
+	dst->trees = (struct hs_tree *)(base + HS_CLONE_ALIGN(sizeof(*src)));
+	dst->region = base;
+	dst->region_size = size;
+	dst->region_alloc = *alloc;
+
+	size = HS_CLONE_ALIGN(sizeof(*src)) +
+		   HS_CLONE_ALIGN(src->tree_num * sizeof(*src->trees));
+	for (j = 0; j < src->tree_num; j++) {
+		dst->trees[j] = src->trees[j];
+		size = hs_clone_tree(&dst->trees[j], &src->trees[j], base, size);
+	}
+
+	*(typeof(dst) *)dst_result = dst;
+
+	return 0;
+}
+
 void hs_destroy(void *built_result)
 {
 	int i;
 	struct hs_result *hsret;
+	struct hs_alloc alloc;
 
 	if (!built_result) {
 		return;
@@ -642,8 +3342,15 @@ void hs_destroy(void *built_result)
 		return;
 	}
 
+	/* A clone is one block, the result included */
+	if (hsret->region) {
+		alloc = hsret->region_alloc;
+		alloc.free(hsret->region, hsret->region_size, alloc.arg);
+		return;
+	}
+
 	for (i = 0; i < hsret->tree_num; i++) {
-		free(hsret->trees[i].root_node);
+		hs_tree_free(&hsret->trees[i]);
 	}
 
 	free(hsret->trees);
@@ -16,12 +16,50 @@
 #define __HYPERSPLIT_H__
 
 #include <stdint.h>
+#include <limits.h>
 #include "mpool.h"
 #include "rule_trace.h"
+#include "hs_exact.h"
+#include "counter.h"
 
 #define NODE_NUM_BITS 29
 #define NODE_NUM_MAX (1 << NODE_NUM_BITS)
 
+/* search over 8-byte struct hs_cnode instead of struct hs_node */
+//#define ENABLE_COMPACT_NODE	1
+
+#define CNODE_DIM_BITS 3
+#define CNODE_LCHILD_BITS 14
+#define CNODE_RCHILD_BITS 15
+#define CNODE_DIM_WIDE ((1 << CNODE_DIM_BITS) - 1)
+#define CNODE_NEXT ((1 << CNODE_LCHILD_BITS) - 1)
+#define CNODE_LEAF (1 << (CNODE_RCHILD_BITS - 1))
+
+/* packets kept in flight by hs_search_batch() */
+#define HS_BATCH_SIZE 8
+
+/* trees walked in lockstep by hs_search_pkt_interleave() */
+#define HS_INTERLEAVE_WAYS 4
+
+/* root jump table, see hs_tree_jump() */
+#define HS_JUMP_BITS_MAX 12
+#define HS_JUMP_BIT_COST 0.5 /* levels a table bit must save */
+
+#define HS_CACHE_LINE 64
+/* children of a k-ary node, see struct hs_knode */
+#define HS_KNODE_FANOUT 8
+
+/*
+ * child ids with this bit refer to a leaf bucket, see struct hs_bucket, or
+ * to a rule list in multi-match trees, see hs_tree.lists
+ */
+#define HS_BUCKET_FLAG (1 << (NODE_NUM_BITS - 1))
+#define HS_BUCKET_LANES 8
+/* node slots per cache line block, see hs_relayout_blocked() */
+#define HS_BLOCK_SLOTS (HS_CACHE_LINE / sizeof(struct hs_node))
+/* hs_config.multi to list every matching rule */
+#define HS_MULTI_ALL INT_MAX
+
 
 struct hs_node {
 	uint64_t	threshold;
@@ -31,25 +69,241 @@ struct hs_node {
 	uint32_t	rchild : NODE_NUM_BITS;
 };
 
+/*
+ * Compact node, laid out in depth first order so that an internal left
+ * child is always the next node:
+ *   lchild: CNODE_NEXT for the next node, otherwise the leaf priority
+ *   rchild: CNODE_LEAF | priority for a leaf, otherwise the distance to
+ *           the right child
+ * A node whose children do not fit has dim == CNODE_DIM_WIDE, and
+ * (lchild << CNODE_RCHILD_BITS | rchild) indexes a wide struct hs_node
+ * whose children are cnode ids + offset, as in the wide tree.
+ */
+struct hs_cnode {
+	uint32_t	threshold;
+	uint32_t	dim    : CNODE_DIM_BITS;
+	uint32_t	lchild : CNODE_LCHILD_BITS;
+	uint32_t	rchild : CNODE_RCHILD_BITS;
+};
+
+/*
+ * K-ary node, one cache line: the child index is the number of thresholds
+ * below the packet field. Unused thresholds are UINT32_MAX.
+ */
+struct hs_knode {
+	uint32_t	thresholds[HS_KNODE_FANOUT - 1];
+	uint32_t	dim;
+	uint32_t	children[HS_KNODE_FANOUT];
+};
+
+/*
+ * Rules of a leaf bucket in SoA form, HS_BUCKET_LANES at a time and in
+ * ascending priority. Padding lanes have an empty range and never match.
+ */
+struct hs_bucket_block {
+	uint32_t	lo[DIM_MAX][HS_BUCKET_LANES];
+	uint32_t	hi[DIM_MAX][HS_BUCKET_LANES];
+	int			pri[HS_BUCKET_LANES];
+};
+
+struct hs_bucket {
+	uint32_t	block; /* first block in hs_tree.blocks */
+	uint32_t	block_num;
+};
+
 struct hs_tree {
 	struct hs_node	*root_node;
+	struct hs_knode *knodes; /* instead of root_node for k-ary trees */
+	struct hs_bucket *buckets; /* leaves of binth trees */
+	struct hs_bucket_block *blocks;
+	int				bucket_num;
+	int				block_num;
+	/*
+	 * leaves of multi-match trees: list i is lists[list_offs[i]] up to
+	 * lists[list_offs[i + 1]], the rule number and the ascending
+	 * priorities as deltas, all in LEB128 varints
+	 */
+	uint8_t			*lists;
+	uint32_t		*list_offs;
+	int				list_num;
+	int				list_max; /* rules in the longest list */
+	int				node_num; /* slots in root_node, >= inode_num */
 	int				inode_num;
 	int				enode_num;
 	int				depth_max;
 	//double depth_avg;
+	int				pri_min; /* best priority the tree can return */
+	int				dag; /* nodes are shared, see hs_tree_dedup() */
+	uint32_t		*jump; /* NULL if not worthwhile */
+	int				jump_dim;
+	int				jump_shift;
+	int				jump_bits;
+#ifdef ENABLE_COMPACT_NODE
+	struct hs_cnode *cnodes;
+	struct hs_node	*wnodes;
+	int				cnode_num;
+	int				wnode_num;
+#endif
+};
+
+struct hs_config {
+	int	fanout; /* 2 for binary nodes, otherwise 4 or HS_KNODE_FANOUT */
+	int	binth; /* binary nodes with up to binth rules become buckets */
+	int	dedup; /* share identical subtrees of binary trees */
+	const struct hs_exact *exact; /* rules moved out by hs_exact_split() */
+	int	multi; /* leaves list the best multi rules, 0 for the best only */
+	struct hit_counter *counter; /* searches count the matched rules */
+	int	threads; /* build threads, 0 or 1 for one tree after another */
+	int	jump; /* root jump tables for hs_search_jump() */
+};
+
+/* Storage for hs_clone(), free() gets the size alloc() was asked for */
+struct hs_alloc {
+	void	*(*alloc)(size_t size, void *arg);
+	void	(*free)(void *ptr, size_t size, void *arg);
+	void	*arg;
 };
 
 struct hs_result {
 	struct hs_tree	*trees;
 	int				tree_num;
 	int				def_rule;
+	uint32_t		gen; /* differs between builds, see fc_search() */
+	const struct hs_exact *exact; /* NULL if every rule is in the trees */
+	int				multi; /* hs_config.multi of the build */
+	struct hit_counter *counter; /* NULL if searches do not count */
+	void			*region; /* the whole forest if made by hs_clone() */
+	size_t			region_size;
+	struct hs_alloc region_alloc;
 };
 
 MPOOL(hsn_pool, struct hs_node);
+MPOOL(hsk_pool, struct hs_knode);
+
+#ifdef ENABLE_COMPACT_NODE
+static inline uint32_t hs_cnode_walk(const struct hs_tree *p_tree,
+									 const struct packet *p_pkt,
+									 uint32_t offset)
+{
+	register uint32_t id;
+	register const struct hs_node *p_wnode;
+	register const struct hs_cnode *p_cnode = p_tree->cnodes;
+
+	for (;;) {
+		if (p_cnode->dim != CNODE_DIM_WIDE) {
+			if (p_pkt->dims[p_cnode->dim] <= p_cnode->threshold) {
+				if (p_cnode->lchild != CNODE_NEXT) {
+					return p_cnode->lchild;
+				}
+				p_cnode++;
+			}
+			else {
+				if (p_cnode->rchild & CNODE_LEAF) {
+					return p_cnode->rchild & ~CNODE_LEAF;
+				}
+				p_cnode += p_cnode->rchild;
+			}
+
+			continue;
+		}
+
+		p_wnode = &p_tree->wnodes[(p_cnode->lchild << CNODE_RCHILD_BITS) |
+								  p_cnode->rchild];
+		if (p_pkt->dims[p_wnode->dim] <= p_wnode->threshold) {
+			id = p_wnode->lchild;
+		}
+		else {
+			id = p_wnode->rchild;
+		}
+
+		if (id < offset) {
+			return id;
+		}
+
+		p_cnode = p_tree->cnodes + id - offset;
+	}
+}
+#endif
+
+/* Walk every tree for one packet and return the best of pri and its rules */
+static inline int hs_search_pkt_below(const struct hs_result *hsret,
+									  const struct packet *p_pkt, int pri)
+{
+	int j;
+	register uint32_t id, offset = hsret->def_rule + 1;
+#ifndef ENABLE_COMPACT_NODE
+	register const struct hs_node *p_node, *root_node;
+#endif
+
+	/* Exact-match hits first, they end the tree walks early */
+	if (hsret->exact) {
+		pri = hs_exact_search_pkt(hsret->exact, p_pkt, pri);
+	}
+
+	/* For each tree, in ascending order of pri_min */
+	for (j = 0; j < hsret->tree_num; j++) {
+		if (pri < hsret->trees[j].pri_min) {
+			break;
+		}
+
+#ifdef ENABLE_COMPACT_NODE
+		id = hs_cnode_walk(&hsret->trees[j], p_pkt, offset);
+#else
+		/* For each node */
+		id = offset;
+		root_node = hsret->trees[j].root_node;
+
+		do {
+			p_node = root_node + id - offset;
+
+			if (p_pkt->dims[p_node->dim] <= p_node->threshold) {
+				id = p_node->lchild;
+			}
+			else {
+				id = p_node->rchild;
+			}
+		} while (id >= offset);
+#endif
+
+		if (id < pri) {
+			pri = id;
+		}
+	}
+
+	return pri;
+}
+
+/* Walk every tree for one packet and return the highest priority rule */
+static inline int hs_search_pkt(const struct hs_result *hsret,
+								const struct packet *p_pkt)
+{
+	return hs_search_pkt_below(hsret, p_pkt, hsret->def_rule);
+}
 
 
 int hs_build(void *built_result, const struct partition *part);
+int hs_build_config(void *built_result, const struct partition *part,
+					const struct hs_config *cfg);
 int hs_search(const struct trace *trace, const void *built_result);
+int hs_search_batch(const struct trace *trace, const void *built_result);
+int hs_search_pkt_interleave(const struct hs_result *hsret,
+							 const struct packet *p_pkt);
+int hs_search_interleave(const struct trace *trace, const void *built_result);
+int hs_search_simd(const struct trace *trace, const void *built_result);
+int hs_search_jump(const struct trace *trace, const void *built_result);
+int hs_search_kary(const struct trace *trace, const void *built_result);
+int hs_search_binth(const struct trace *trace, const void *built_result);
+int hs_multi_max(const void *built_result);
+int hs_search_multi(const struct trace *trace, const void *built_result,
+					int *matches, int *match_nums);
+int hs_clone(void *dst_result, const void *src_result,
+			 const struct hs_alloc *alloc);
 void hs_destroy(void *built_result);
 
+int hs_relayout_blocked(void *built_result);
+int hs_reorder(void *built_result, const struct trace *trace);
+#ifdef ENABLE_COMPACT_NODE
+int hs_compact(void *built_result);
+#endif
+
 #endif /* __HYPERSPLIT_H__ */
@@ -18,6 +18,7 @@ VECTOR_GENERATE(extern, rule_vector, struct rule)
 
 /* mpool */
 MPOOL_GENERATE(extern, hsn_pool)
+MPOOL_GENERATE(extern, hsk_pool)
 
 /* sort */
 static inline long int_cmp(const int *p_left, const int *p_right)
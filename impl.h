@@ -27,6 +27,7 @@ VECTOR_PROTOTYPE(extern, rule_vector, struct rule)
 
 /* mpool */
 MPOOL_PROTOTYPE(extern, hsn_pool)
+MPOOL_PROTOTYPE(extern, hsk_pool)
 
 /* sort */
 ISORT_PROTOTYPE(extern, int, int)
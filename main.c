@@ -18,13 +18,25 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "rule_trace.h"
 #include "hypersplit.h"
+#include "hs_codegen.h"
+#include "hs_jit.h"
+#include "rank.h"
+#include "flow_cache.h"
+#include "hs_exact.h"
+#include "dispatch.h"
+#include "counter.h"
+#include "hugepage.h"
+#include "numa.h"
+#include "parallel.h"
 #include "rfg.h"
 #include "dbg.h"
 
@@ -50,13 +62,55 @@ enum {
 	GRP_ALGO_MAX	= 1
 };
 
+enum {
+	LAYOUT_DEFAULT	= 0,
+	LAYOUT_BLOCK	= 1,
+	LAYOUT_MAX		= 2
+};
+
+enum {
+	SEARCH_MODE_INV		= -1,
+	SEARCH_MODE_SCALAR	= 0,
+	SEARCH_MODE_BATCH	= 1,
+	SEARCH_MODE_SIMD	= 2,
+	SEARCH_MODE_JUMP	= 3,
+	SEARCH_MODE_CODEGEN	= 4,
+	SEARCH_MODE_JIT		= 5,
+	SEARCH_MODE_KARY	= 6,
+	SEARCH_MODE_BINTH	= 7,
+	SEARCH_MODE_DISPATCH = 8,
+	SEARCH_MODE_PREFILTER = 9,
+	SEARCH_MODE_MULTI	= 10,
+	SEARCH_MODE_INTERLEAVE = 11,
+	SEARCH_MODE_MAX		= 12
+};
+
 
 struct platform_config {
 	char	*s_rule_file;
 	char	*s_trace_file;
+	char	*s_profile_file;
+	char	*s_codegen_prefix;
+	char	*s_counter_file;
 	int		rule_fmt;
 	int		pc_algo;
 	int		grp_algo;
+	int		search_mode;
+	int		layout;
+	int		rank;
+	int		fanout;
+	int		binth;
+	int		dedup;
+	int		exact;
+	int		dispatch;
+	int		prefilter;
+	int		multi;
+	int		hugepage;
+	int		numa;
+	int		threads;
+	int		build_threads;
+	int		cache_bits;
+	int		cache_policy;
 };
 
 void test_mitvt(char *rule_file, char *trace_file);
@@ -70,9 +124,31 @@ static void print_help(void)
 		"  -r, --rule FILE  specify a rule file for building"
 		"  -f, --format FORMAT  specify a rule file format: [wustl, wustl_g]"
 		"  -t, --trace FILE  specify a trace file for searching"
+		"  -P, --profile FILE  specify a trace file for node reordering"
 		""
 		"  -p, --pc ALGO  specify a pc algorithm: [hs]"
 		"  -g, --grp ALGO  specify a grp algorithm: [rfg]"
+		"  -s, --search MODE  specify a search mode: [scalar, batch, simd, jump,"
+		"                     interleave, jit]"
+		"  -l, --layout LAYOUT  specify a node layout: [default, block]"
+		"  -G, --codegen PREFIX  compile trees into PREFIX.so and search with it"
+		"  -R, --rank  build and search in rank space"
+		"  -k, --fanout N  build k-ary nodes with N children: [2, 4, 8]"
+		"  -b, --binth N  make nodes with up to N rules leaf buckets"
+		"  -D, --dedup  share identical subtrees"
+		"  -n, --nic  build one forest per NIC besides a shared one"
+		"  -F, --prefilter  pick a forest by proto and dport before searching"
+		"  -x, --exact  move point rules into exact-match hash tables"
+		"  -m, --multi K  report the best K matching rules, 0 for all"
+		"  -H, --hugepage  keep the forest and the packets on huge pages"
+		"  -j, --jobs N  search chunks of the trace with N pinned threads"
+		"  -B, --build-jobs N  build the trees with N threads"
+		"  -N, --numa  also search with a thread per CPU, from one shared"
+		"              forest and from a replica on every NUMA node"
+		"  -C, --counter FILE  count hits per rule, dumped to FILE at exit"
+		"                      or on SIGUSR1 (needs ENABLE_HIT_COUNTER)"
+		"  -c, --cache BITS  also search behind a flow cache of 2^BITS sets"
+		"  -e, --evict POLICY  specify a cache replacement: [lru, fifo, random]"
 		""
 		"  -h, --help  display this help and exit"
 		"";
@@ -85,13 +161,32 @@ static void print_help(void)
 static void parse_args(struct platform_config *plat_cfg, int argc, char *argv[])
 {
 	int option;
-	const char *s_opts = "r:f:t:p:g:h";
+	const char *s_opts = "r:f:t:P:p:g:s:l:G:Rk:b:DnFxm:HNj:B:C:c:e:h";
 	const struct option opts[] = {
 		{ "rule",	required_argument, NULL, 'r' },
 		{ "format", required_argument, NULL, 'f' },
 		{ "trace",	required_argument, NULL, 't' },
+		{ "profile", required_argument, NULL, 'P' },
 		{ "pc",		required_argument, NULL, 'p' },
 		{ "grp",	required_argument, NULL, 'g' },
+		{ "search", required_argument, NULL, 's' },
+		{ "layout", required_argument, NULL, 'l' },
+		{ "codegen", required_argument, NULL, 'G' },
+		{ "rank",	no_argument,	   NULL, 'R' },
+		{ "fanout", required_argument, NULL, 'k' },
+		{ "binth",	required_argument, NULL, 'b' },
+		{ "dedup",	no_argument,	   NULL, 'D' },
+		{ "nic",	no_argument,	   NULL, 'n' },
+		{ "prefilter", no_argument,	   NULL, 'F' },
+		{ "exact",	no_argument,	   NULL, 'x' },
+		{ "multi",	required_argument, NULL, 'm' },
+		{ "hugepage", no_argument,	   NULL, 'H' },
+		{ "numa",	no_argument,	   NULL, 'N' },
+		{ "jobs",	required_argument, NULL, 'j' },
+		{ "build-jobs", required_argument, NULL, 'B' },
+		{ "counter", required_argument, NULL, 'C' },
+		{ "cache",	required_argument, NULL, 'c' },
+		{ "evict",	required_argument, NULL, 'e' },
 		{ "help",	no_argument,	   NULL, 'h' },
 		{ NULL,		0,				   NULL, 0	 }
 	};
@@ -107,6 +202,7 @@ static void parse_args(struct platform_config *plat_cfg, int argc, char *argv[])
 		switch (option) {
 		case 'r':
 		case 't':
+		case 'P':
 			if (access(optarg, F_OK) == -1) {
 				dbg("ERROR: no file: %s", optarg);
 				exit(-1);
@@ -118,6 +214,9 @@ static void parse_args(struct platform_config *plat_cfg, int argc, char *argv[])
 			else if (option == 't') {
 				plat_cfg->s_trace_file = optarg;
 			}
+			else if (option == 'P') {
+				plat_cfg->s_profile_file = optarg;
+			}
 
 			break;
 
@@ -145,6 +244,154 @@ static void parse_args(struct platform_config *plat_cfg, int argc, char *argv[])
 
 			break;
 
+		case 's':
+			if (!strcmp(optarg, "scalar")) {
+				plat_cfg->search_mode = SEARCH_MODE_SCALAR;
+			}
+			else if (!strcmp(optarg, "batch")) {
+				plat_cfg->search_mode = SEARCH_MODE_BATCH;
+			}
+			else if (!strcmp(optarg, "simd")) {
+				plat_cfg->search_mode = SEARCH_MODE_SIMD;
+			}
+			else if (!strcmp(optarg, "jump")) {
+				plat_cfg->search_mode = SEARCH_MODE_JUMP;
+			}
+			else if (!strcmp(optarg, "interleave")) {
+				plat_cfg->search_mode = SEARCH_MODE_INTERLEAVE;
+			}
+			else if (!strcmp(optarg, "jit")) {
+				plat_cfg->search_mode = SEARCH_MODE_JIT;
+			}
+			else {
+				dbg("Unknown search mode: %s", optarg);
+				exit(-1);
+			}
+
+			break;
+
+		case 'l':
+			if (!strcmp(optarg, "default")) {
+				plat_cfg->layout = LAYOUT_DEFAULT;
+			}
+			else if (!strcmp(optarg, "block")) {
+				plat_cfg->layout = LAYOUT_BLOCK;
+			}
+			else {
+				dbg("Unknown node layout: %s", optarg);
+				exit(-1);
+			}
+
+			break;
+
+		case 'G':
+			plat_cfg->s_codegen_prefix = optarg;
+			plat_cfg->search_mode = SEARCH_MODE_CODEGEN;
+			break;
+
+		case 'R':
+			plat_cfg->rank = 1;
+			break;
+
+		case 'k':
+			plat_cfg->fanout = strtol(optarg, NULL, 0);
+			if (plat_cfg->fanout != 2 && plat_cfg->fanout != 4 &&
+				plat_cfg->fanout != HS_KNODE_FANOUT) {
+				dbg("Invalid fanout: %s", optarg);
+				exit(-1);
+			}
+			break;
+
+		case 'b':
+			plat_cfg->binth = strtol(optarg, NULL, 0);
+			if (plat_cfg->binth < 0) {
+				dbg("Invalid bucket size: %s", optarg);
+				exit(-1);
+			}
+			break;
+
+		case 'D':
+			plat_cfg->dedup = 1;
+			break;
+
+		case 'n':
+			plat_cfg->dispatch = 1;
+			break;
+
+		case 'F':
+			plat_cfg->prefilter = 1;
+			break;
+
+		case 'x':
+			plat_cfg->exact = 1;
+			break;
+
+		case 'm':
+			plat_cfg->multi = strtol(optarg, NULL, 0);
+			if (plat_cfg->multi < 0) {
+				dbg("Invalid number of matches: %s", optarg);
+				exit(-1);
+			}
+			else if (plat_cfg->multi == 0) {
+				plat_cfg->multi = HS_MULTI_ALL;
+			}
+			break;
+
+		case 'H':
+			plat_cfg->hugepage = 1;
+			break;
+
+		case 'N':
+			plat_cfg->numa = 1;
+			break;
+
+		case 'j':
+			plat_cfg->threads = strtol(optarg, NULL, 0);
+			if (plat_cfg->threads <= 0 || plat_cfg->threads > PAR_THREAD_MAX) {
+				dbg("Invalid number of threads: %s", optarg);
+				exit(-1);
+			}
+			break;
+
+		case 'B':
+			plat_cfg->build_threads = strtol(optarg, NULL, 0);
+			if (plat_cfg->build_threads <= 0 ||
+				plat_cfg->build_threads > PART_MAX) {
+				dbg("Invalid number of build threads: %s", optarg);
+				exit(-1);
+			}
+			break;
+
+		case 'C':
+			plat_cfg->s_counter_file = optarg;
+			break;
+
+		case 'c':
+			plat_cfg->cache_bits = strtol(optarg, NULL, 0);
+			if (plat_cfg->cache_bits < 0 ||
+				plat_cfg->cache_bits > FC_SET_BITS_MAX) {
+				dbg("Invalid number of cache set bits: %s", optarg);
+				exit(-1);
+			}
+			break;
+
+		case 'e':
+			if (!strcmp(optarg, "lru")) {
+				plat_cfg->cache_policy = FC_POLICY_LRU;
+			}
+			else if (!strcmp(optarg, "fifo")) {
+				plat_cfg->cache_policy = FC_POLICY_FIFO;
+			}
+			else if (!strcmp(optarg, "random")) {
+				plat_cfg->cache_policy = FC_POLICY_RANDOM;
+			}
+			else {
+				dbg("Unknown cache replacement: %s", optarg);
+				exit(-1);
+			}
+
+			break;
+
 		case 'h':
 			print_help();
 			exit(0);
@@ -181,6 +428,138 @@ static void parse_args(struct platform_config *plat_cfg, int argc, char *argv[])
 		exit(-1);
 	}
 
+	if (plat_cfg->dedup &&
+		(plat_cfg->layout != LAYOUT_DEFAULT || plat_cfg->s_profile_file)) {
+		dbg("Shared subtrees cannot be laid out again");
+		exit(-1);
+	}
+
+#ifdef ENABLE_COMPACT_NODE
+	/* hs_compact() encodes the wide trees depth first once they are built */
+	if (plat_cfg->dedup || plat_cfg->layout != LAYOUT_DEFAULT ||
+		plat_cfg->s_profile_file) {
+		dbg("Compact nodes cannot be shared, reordered or laid out again");
+		exit(-1);
+	}
+#endif
+
+	/* hs_codegen() would emit a shared subtree once per parent */
+	if (plat_cfg->dedup && plat_cfg->s_codegen_prefix) {
+		dbg("Shared subtrees cannot be generated as code");
+		exit(-1);
+	}
+
+	if (plat_cfg->cache_bits >= 0 &&
+		(plat_cfg->fanout != 2 || plat_cfg->binth ||
+		 plat_cfg->layout != LAYOUT_DEFAULT)) {
+		dbg("The flow cache only supports binary nodes and the default layout");
+		exit(-1);
+	}
+
+	if (plat_cfg->s_counter_file) {
+#ifdef ENABLE_HIT_COUNTER
+		if (plat_cfg->search_mode == SEARCH_MODE_CODEGEN ||
+			plat_cfg->search_mode == SEARCH_MODE_JIT) {
+			dbg("Compiled trees do not count hits");
+			exit(-1);
+		}
+#else
+		dbg("Hit counters are not built in, see ENABLE_HIT_COUNTER");
+		exit(-1);
+#endif
+	}
+
+	if (plat_cfg->dispatch || plat_cfg->prefilter) {
+#ifndef ENABLE_NIC
+		if (plat_cfg->dispatch) {
+			dbg("Rules carry no NIC, see ENABLE_NIC");
+			exit(-1);
+		}
+#endif
+
+		if (plat_cfg->dispatch && plat_cfg->prefilter) {
+			dbg("Cannot dispatch by NIC and prefilter at once");
+			exit(-1);
+		}
+
+		if (plat_cfg->rule_fmt != RULE_FMT_WUSTL ||
+			plat_cfg->search_mode != SEARCH_MODE_SCALAR ||
+			plat_cfg->layout != LAYOUT_DEFAULT || plat_cfg->s_profile_file ||
+			plat_cfg->fanout != 2 || plat_cfg->binth || plat_cfg->rank ||
+			plat_cfg->exact || plat_cfg->cache_bits >= 0 ||
+			plat_cfg->hugepage) {
+			dbg("Dispatch only supports wustl rules and the scalar search");
+			exit(-1);
+		}
+
+		plat_cfg->search_mode = plat_cfg->dispatch ? SEARCH_MODE_DISPATCH :
+							 SEARCH_MODE_PREFILTER;
+	}
+
+	if (plat_cfg->multi) {
+		if (plat_cfg->search_mode != SEARCH_MODE_SCALAR ||
+			plat_cfg->layout != LAYOUT_DEFAULT || plat_cfg->s_profile_file ||
+			plat_cfg->fanout != 2 || plat_cfg->binth || plat_cfg->exact ||
+			plat_cfg->cache_bits >= 0) {
+			dbg("Multi-match only supports the scalar search and layout");
+			exit(-1);
+		}
+
+		plat_cfg->search_mode = SEARCH_MODE_MULTI;
+	}
+
+	if (plat_cfg->threads &&
+		(plat_cfg->search_mode == SEARCH_MODE_MULTI ||
+		 (plat_cfg->s_counter_file && plat_cfg->threads > COUNTER_SHARD_MAX))) {
+		dbg("Threads do not support multi-match, or hit counters beyond %d",
+			COUNTER_SHARD_MAX);
+		exit(-1);
+	}
+
+	/* The threads share everything but the forest and the packets */
+	if (plat_cfg->numa &&
+		(plat_cfg->search_mode == SEARCH_MODE_CODEGEN ||
+		 plat_cfg->search_mode == SEARCH_MODE_JIT ||
+		 plat_cfg->search_mode == SEARCH_MODE_DISPATCH ||
+		 plat_cfg->search_mode == SEARCH_MODE_PREFILTER ||
+		 plat_cfg->search_mode == SEARCH_MODE_MULTI ||
+		 plat_cfg->s_counter_file)) {
+		dbg("NUMA replicas only support searches of a single forest");
+		exit(-1);
+	}
+
+	if (plat_cfg->exact &&
+		((plat_cfg->search_mode != SEARCH_MODE_SCALAR &&
+		  plat_cfg->search_mode != SEARCH_MODE_BATCH) ||
+		 plat_cfg->fanout != 2 || plat_cfg->binth)) {
+		dbg("Exact-match tables only support the scalar and batch searches");
+		exit(-1);
+	}
+
+	if (plat_cfg->fanout != 2) {
+		if (plat_cfg->search_mode != SEARCH_MODE_SCALAR ||
+			plat_cfg->layout != LAYOUT_DEFAULT || plat_cfg->s_profile_file) {
+			dbg("K-ary nodes only support the default search and layout");
+			exit(-1);
+		}
+
+		if (plat_cfg->dedup || plat_cfg->binth) {
+			dbg("K-ary nodes cannot be shared or made buckets");
+			exit(-1);
+		}
+
+		plat_cfg->search_mode = SEARCH_MODE_KARY;
+	}
+	else if (plat_cfg->binth) {
+		if (plat_cfg->search_mode != SEARCH_MODE_SCALAR ||
+			plat_cfg->layout != LAYOUT_DEFAULT || plat_cfg->s_profile_file) {
+			dbg("Buckets only support the default search and layout");
+			exit(-1);
+		}
+
+		plat_cfg->search_mode = SEARCH_MODE_BINTH;
+	}
+
 	return;
 }
 
@@ -269,6 +648,201 @@ static void f_destroy(int pc_algo, void *built_result)
 
 #endif
 
+static struct hs_codegen codegen;
+static struct hs_jit jit;
+static struct rank_map rank;
+static struct hs_exact exact;
+static struct dispatch disp;
+static struct prefilter pf;
+static int *multi_matches, *multi_nums;
+static struct hit_counter counter;
+
+static int search_trace(const struct platform_config *plat_cfg,
+						const struct trace *p_t, const void *built_result)
+{
+	switch (plat_cfg->search_mode) {
+	case SEARCH_MODE_CODEGEN:
+		return hs_codegen_search(p_t, &codegen);
+
+	case SEARCH_MODE_JIT:
+		return hs_jit_search(p_t, &jit);
+
+	case SEARCH_MODE_KARY:
+		return hs_search_kary(p_t, built_result);
+
+	case SEARCH_MODE_BINTH:
+		return hs_search_binth(p_t, built_result);
+
+	case SEARCH_MODE_DISPATCH:
+		return dispatch_search(p_t, &disp);
+
+	case SEARCH_MODE_PREFILTER:
+		return prefilter_search(p_t, &pf);
+
+	case SEARCH_MODE_MULTI:
+		return hs_search_multi(p_t, built_result, multi_matches, multi_nums);
+
+	case SEARCH_MODE_BATCH:
+		return hs_search_batch(p_t, built_result);
+
+	case SEARCH_MODE_SIMD:
+		return hs_search_simd(p_t, built_result);
+
+	case SEARCH_MODE_JUMP:
+		return hs_search_jump(p_t, built_result);
+
+	case SEARCH_MODE_INTERLEAVE:
+		return hs_search_interleave(p_t, built_result);
+
+	case SEARCH_MODE_SCALAR:
+	default:
+		return hs_search(p_t, built_result);
+	}
+}
+
+struct par_context {
+	const struct platform_config *plat_cfg;
+	const void	*result;
+};
+
+static int par_search_chunk(const struct trace *chunk, int worker, void *arg)
+{
+	const struct par_context *ctx = arg;
+
+	if (ctx->plat_cfg->s_counter_file) {
+		counter_shard_set(&counter, worker);
+	}
+
+	return search_trace(ctx->plat_cfg, chunk, ctx->result);
+}
+
+struct numa_worker {
+	pthread_t			tid;
+	int					cpu;
+	int					node;
+	int					ret;
+	int					mismatch_num;
+	uint64_t			timediff;
+	const struct platform_config *plat_cfg;
+	const struct trace	*trace;
+	const void			*result; /* the shared forest */
+	const struct numa_replicas *reps; /* NULL to search the shared forest */
+	pthread_barrier_t	*barrier;
+};
+
+static void *numa_worker_run(void *arg)
+{
+	int i;
+	struct numa_worker *w = arg;
+	struct timespec starttime, stoptime;
+	struct trace t = *w->trace;
+	const void *result = w->result;
+	size_t size = t.pkt_num * sizeof(*t.pkts);
+
+	numa_pin_cpu(w->cpu);
+	w->node = numa_node_self();
+	if (w->reps) {
+		result = numa_replica(w->reps);
+	}
+
+	/* A private copy of the packets, first touched on the local node */
+	t.pkts = malloc(size);
+	if (t.pkts) {
+		memcpy(t.pkts, w->trace->pkts, size);
+	}
+
+	pthread_barrier_wait(w->barrier);
+
+	if (!t.pkts) {
+		w->ret = -ENOMEM;
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
+	w->ret = search_trace(w->plat_cfg, &t, result);
+	clock_gettime(CLOCK_MONOTONIC, &stoptime);
+	w->timediff = make_timediff(stoptime, starttime);
+
+	for (i = 0; i < t.pkt_num; i++) {
+		w->mismatch_num += t.pkts[i].found != t.pkts[i].match_rule;
+	}
+
+	free(t.pkts);
+
+	return NULL;
+}
+
+/*
+ * Search the whole trace from a pinned thread on every CPU at once, from
+ * the shared forest or from the replica of each thread's node.
+ */
+static int numa_bench(const struct platform_config *plat_cfg,
+					  const struct trace *p_t, const void *result,
+					  const struct numa_replicas *reps)
+{
+	int i, cpu_num, ret = 0, mismatch_num = 0;
+	uint64_t timediff = 1;
+	struct numa_worker *workers;
+	pthread_barrier_t barrier;
+
+	cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_num <= 0) {
+		cpu_num = 1;
+	}
+
+	workers = calloc(cpu_num, sizeof(*workers));
+	if (!workers) {
+		return -ENOMEM;
+	}
+
+	pthread_barrier_init(&barrier, NULL, cpu_num);
+
+	for (i = 0; i < cpu_num; i++) {
+		workers[i].cpu = i;
+		workers[i].plat_cfg = plat_cfg;
+		workers[i].trace = p_t;
+		workers[i].result = result;
+		workers[i].reps = reps;
+		workers[i].barrier = &barrier;
+
+		if (pthread_create(&workers[i].tid, NULL, numa_worker_run,
+						   &workers[i])) {
+			dbg("Cannot start the thread of CPU %d", i);
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < cpu_num; i++) {
+		pthread_join(workers[i].tid, NULL);
+
+		if (workers[i].ret) {
+			ret = workers[i].ret;
+		}
+
+		if (workers[i].timediff > timediff) {
+			timediff = workers[i].timediff;
+		}
+
+		mismatch_num += workers[i].mismatch_num;
+	}
+
+	pthread_barrier_destroy(&barrier);
+
+	dbg("%s: %d threads, %d mismatches, slowest %" PRIu64 "(us), "
+		"%lld(pps)", reps ? "Per-node replicas" : "Shared forest", cpu_num,
+		mismatch_num, timediff,
+		(unsigned long long)cpu_num * p_t->pkt_num * 1000000ULL / timediff);
+
+	for (i = 0; i < cpu_num; i++) {
+		dbg("  CPU %d on node %d: %" PRIu64 "(us)", workers[i].cpu,
+			workers[i].node, workers[i].timediff);
+	}
+
+	free(workers);
+
+	return ret;
+}
+
 size_t hs_tree_memory_size(void *hypersplit, uint32_t *total_node)
 {
 	const struct hs_result *hsret;
@@ -285,7 +859,7 @@ size_t hs_tree_memory_size(void *hypersplit, uint32_t *total_node)
 	for (j = 0; j < hsret->tree_num; j++) {
 		struct hs_tree *t = &hsret->trees[j];
 
-		tmem += (t->inode_num * sizeof(struct hs_node));
+		tmem += (t->node_num * sizeof(struct hs_node));
 		nodes += t->inode_num;
 	}
 
@@ -326,7 +900,7 @@ void save_hypersplit(void *hs)
 
 	for (j = 0; j < hsret->tree_num; j++) {
 		struct hs_tree *t = &hsret->trees[j];
-		int mlen = t->inode_num * sizeof(struct hs_node);
+		int mlen = t->node_num * sizeof(struct hs_node);
 
 		tmem += mlen;
 		tnode += t->inode_num;
@@ -374,7 +948,7 @@ void* load_hypersplit(void)
 	dbg("Num Tree: %d ", hs->tree_num);
 	dbg("Def Rule: %d ", hs->def_rule);
 
-	hs->trees = malloc(sizeof(struct hs_tree) * hs->tree_num);
+	hs->trees = calloc(hs->tree_num, sizeof(struct hs_tree));
 
 	int j, tmem = 0, tnode = 0;
 
@@ -391,7 +965,9 @@ void* load_hypersplit(void)
 		tnode += t->inode_num;
 		tmem += mlen;
 
-		if ((t->inode_num * sizeof(struct hs_node)) != mlen) {
+		/* blocked layouts carry padding slots */
+		t->node_num = mlen / sizeof(struct hs_node);
+		if (t->node_num < t->inode_num) {
 			dbg("something wrong: mlen=%d ", mlen);
 		}
 
@@ -407,6 +983,12 @@ void* load_hypersplit(void)
 
 	dbg("Total: Node=%d, Mem=%d ", tnode, tmem);
 
+#ifdef ENABLE_COMPACT_NODE
+	if (hs_compact(&hs)) {
+		dbg("cannot encode compact nodes");
+	}
+#endif
+
 	return hs;
 }
 
@@ -422,9 +1004,28 @@ int main(int argc, char *argv[])
 	struct platform_config plat_cfg = {
 		.s_rule_file	= NULL,
 		.s_trace_file	= NULL,
+		.s_profile_file = NULL,
+		.s_codegen_prefix = NULL,
+		.s_counter_file = NULL,
 		.rule_fmt		= RULE_FMT_INV,
 		.pc_algo		= PC_ALGO_INV,
-		.grp_algo		= GRP_ALGO_INV
+		.grp_algo		= GRP_ALGO_INV,
+		.search_mode	= SEARCH_MODE_SCALAR,
+		.layout			= LAYOUT_DEFAULT,
+		.rank			= 0,
+		.fanout			= 2,
+		.binth			= 0,
+		.dedup			= 0,
+		.exact			= 0,
+		.dispatch		= 0,
+		.prefilter		= 0,
+		.multi			= 0,
+		.hugepage		= 0,
+		.numa			= 0,
+		.threads		= 0,
+		.build_threads	= 0,
+		.cache_bits		= -1,
+		.cache_policy	= FC_POLICY_LRU
 	};
 
 	parse_args(&plat_cfg, argc, argv);
@@ -453,7 +1054,8 @@ int main(int argc, char *argv[])
 		dbg("Grouping ... ");
 		fflush(NULL);
 
-		if (pa.rule_num > 2) {
+		/* Dispatched forests are grouped one by one */
+		if (pa.rule_num > 2 && !plat_cfg.dispatch && !plat_cfg.prefilter) {
 			if (rf_group(&pa_grp, &pa)) {
 				dbg("Error Grouping ... ");
 				exit(-1);
@@ -549,6 +1151,38 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	if (plat_cfg.rank) {
+		dbg("Mapping rules into rank space");
+
+		clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+		if (rank_build(&rank, &pa) || rank_rules(&rank, &pa)) {
+			dbg("Rank space fail");
+			exit(-1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stoptime);
+
+		dbg("Time for rank space: %" PRIu64 "(us)",
+			make_timediff(stoptime, starttime));
+	}
+
+	if (plat_cfg.exact) {
+		dbg("Moving point rules into exact-match tables");
+
+		clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+		if (hs_exact_split(&exact, &pa)) {
+			dbg("Exact match fail");
+			exit(-1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stoptime);
+
+		dbg("Time for exact match: %" PRIu64 "(us)",
+			make_timediff(stoptime, starttime));
+	}
+
 	/*
 	 * Building
 	 */
@@ -557,8 +1191,40 @@ int main(int argc, char *argv[])
 
 	clock_gettime(CLOCK_MONOTONIC, &starttime);
 
+	if (plat_cfg.s_counter_file) {
+		if (counter_init(&counter, pa.subsets[0].def_rule + 1,
+						 plat_cfg.threads ? plat_cfg.threads : 1) ||
+			counter_dump_on_signal(&counter, plat_cfg.s_counter_file)) {
+			dbg("Hit counter fail");
+			exit(-1);
+		}
+	}
+
+	struct hs_config hs_cfg = {
+		.fanout = plat_cfg.fanout,
+		.binth	= plat_cfg.binth,
+		.dedup	= plat_cfg.dedup,
+		.exact	= plat_cfg.exact ? &exact : NULL,
+		.multi	= plat_cfg.multi,
+		.counter = plat_cfg.s_counter_file ? &counter : NULL,
+		.threads = plat_cfg.build_threads,
+		.jump	= plat_cfg.search_mode == SEARCH_MODE_JUMP
+	};
+
+	if (plat_cfg.dispatch) {
+		if (dispatch_build(&disp, pa.subsets, &hs_cfg)) {
+			dbg("Building fail");
+			exit(-1);
+		}
+	}
+	else if (plat_cfg.prefilter) {
+		if (prefilter_build(&pf, pa.subsets, &hs_cfg)) {
+			dbg("Building fail");
+			exit(-1);
+		}
+	}
 	//call hs_build()
-	if (hs_build(&result, &pa)) {
+	else if (hs_build_config(&result, &pa, &hs_cfg)) {
 		dbg("Building fail");
 		exit(-1);
 	}
@@ -572,7 +1238,96 @@ int main(int argc, char *argv[])
 
 	unload_partition(&pa);
 
+	if (plat_cfg.s_profile_file) {
+		dbg("Reordering nodes by profile");
+
+		if (load_trace(&t, plat_cfg.s_profile_file)) {
+			exit(-1);
+		}
+
+		if (plat_cfg.rank && rank_trace(&rank, &t)) {
+			exit(-1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+		if (hs_reorder(&result, &t)) {
+			dbg("Reordering fail");
+			exit(-1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stoptime);
+
+		dbg("Time for reordering: %" PRIu64 "(us)",
+			make_timediff(stoptime, starttime));
+
+		unload_trace(&t);
+	}
+
+	if (plat_cfg.layout == LAYOUT_BLOCK) {
+		dbg("Relayout into cache line blocks");
+
+		if (hs_relayout_blocked(&result)) {
+			dbg("Relayout fail");
+			exit(-1);
+		}
+	}
+
+	if (plat_cfg.s_codegen_prefix) {
+		char s_cf[PATH_MAX], s_so[PATH_MAX];
+
+		snprintf(s_cf, sizeof(s_cf), "%s.c", plat_cfg.s_codegen_prefix);
+		snprintf(s_so, sizeof(s_so), "%s.so", plat_cfg.s_codegen_prefix);
+
+		clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+		if (hs_codegen(&result, s_cf) || hs_codegen_compile(s_cf, s_so) ||
+			hs_codegen_load(&codegen, s_so)) {
+			dbg("Code generation fail");
+			exit(-1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stoptime);
+
+		dbg("Time for code generation: %" PRIu64 "(us)",
+			make_timediff(stoptime, starttime));
+	}
+
+	if (plat_cfg.search_mode == SEARCH_MODE_JIT) {
+		clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+		if (hs_jit_compile(&jit, &result)) {
+			dbg("JIT compiling fail");
+			exit(-1);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &stoptime);
+
+		dbg("Time for JIT compiling: %" PRIu64 "(us)",
+			make_timediff(stoptime, starttime));
+	}
+
+	/* Keep the original forest if there is no memory to copy it to */
+	if (plat_cfg.hugepage) {
+		void *hp_result = NULL;
+
+		if (hs_clone(&hp_result, &result, &hp_hs_alloc)) {
+			dbg("Huge pages fail, searching the original forest");
+		}
+		else {
+			hs_destroy(&result);
+			result = hp_result;
+		}
+	}
+
 	if (!plat_cfg.s_trace_file) {
+		counter_destroy(&counter);
+		prefilter_destroy(&pf);
+		dispatch_destroy(&disp);
+		hs_exact_destroy(&exact);
+		rank_destroy(&rank);
+		hs_jit_free(&jit);
+		hs_codegen_unload(&codegen);
 		hs_destroy(&result);
 		return 0;
 	}
@@ -580,14 +1335,84 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
+	/* The packets go to huge pages too, they live until exit like the trace */
+	if (plat_cfg.hugepage) {
+		int hp_kind;
+		size_t size = t.pkt_num * sizeof(*t.pkts);
+		struct packet *pkts = hp_alloc(size, &hp_kind);
+
+		if (pkts) {
+			memcpy(pkts, t.pkts, size);
+			free(t.pkts);
+			t.pkts = pkts;
+			dbg("Packets: %zu Bytes on %s", size, hp_kind_name(hp_kind));
+		}
+		else {
+			dbg("Huge pages fail, searching the original packets");
+		}
+	}
+
+	/* The match lists are filled in place, no allocation while searching */
+	if (plat_cfg.multi) {
+		int multi_max = hs_multi_max(&result);
+
+		if (multi_max > 0) {
+			multi_matches = malloc((size_t)t.pkt_num * multi_max *
+								   sizeof(*multi_matches));
+			multi_nums = malloc(t.pkt_num * sizeof(*multi_nums));
+		}
+
+		if (!multi_matches || !multi_nums) {
+			dbg("Multi-match fail");
+			exit(-1);
+		}
+	}
+
+	/* Results of the threads, chunks on cache lines of their own */
+	int *par_results = NULL;
+	struct par_stats *par_stats = NULL;
+	struct par_context par_ctx = { .plat_cfg = &plat_cfg, .result = &result };
+
+	if (plat_cfg.threads) {
+		if (posix_memalign((void **)&par_results, HS_CACHE_LINE,
+						   t.pkt_num * sizeof(*par_results))) {
+			par_results = NULL;
+		}
+
+		par_stats = calloc(plat_cfg.threads, sizeof(*par_stats));
+		if (!par_results || !par_stats) {
+			dbg("Threads fail");
+			exit(-1);
+		}
+	}
+
 	/*
 	 * Searching
 	 */
 	dbg("Searching");
 
+	uint64_t tlb_start = 0, tlb_stop = 0;
+	int tlb_fd = hp_tlb_open();
+
+	if (tlb_fd >= 0) {
+		hp_tlb_read(tlb_fd, &tlb_start);
+	}
+
 	clock_gettime(CLOCK_MONOTONIC, &starttime);
 
-	if (hs_search(&t, &result)) {
+	/* pre-lookup stage, part of the searching time */
+	if (plat_cfg.rank && rank_trace(&rank, &t)) {
+		dbg("Rank space fail");
+		exit(-1);
+	}
+
+	if (plat_cfg.threads) {
+		if (par_search(&t, par_results, plat_cfg.threads, par_search_chunk,
+					   &par_ctx, par_stats)) {
+			dbg("Searching fail");
+		}
+	}
+	else if (search_trace(&plat_cfg, &t, &result)) {
 		dbg("Searching fail");
 		//exit(-1);
 	}
@@ -598,7 +1423,16 @@ int main(int argc, char *argv[])
 		timediff = 1;
 	}
 
+	if (tlb_fd >= 0) {
+		hp_tlb_read(tlb_fd, &tlb_stop);
+		hp_tlb_close(tlb_fd);
+	}
+
 	int i;
+	for (i = 0; par_results && i < t.pkt_num; i++) {
+		t.pkts[i].found = par_results[i];
+	}
+
 	for (i = 0; i < t.pkt_num; i++) {
 		if (t.pkts[i].found != t.pkts[i].match_rule) {
 			dbg("packet %d match %d, but should match %d",
@@ -611,6 +1445,116 @@ int main(int argc, char *argv[])
 	dbg("Searching speed: %lld(pps)",
 		   (t.pkt_num * 1000000ULL) / timediff);
 
+	for (i = 0; i < plat_cfg.threads; i++) {
+		dbg("  Thread %d on CPU %d: %d chunks, %d steals, %" PRIu64
+			"(us), %lld(pps)", i, par_stats[i].cpu, par_stats[i].chunk_num,
+			par_stats[i].steal_num, par_stats[i].timediff,
+			par_stats[i].timediff ?
+			par_stats[i].pkt_num * 1000000ULL / par_stats[i].timediff : 0ULL);
+	}
+
+	free(par_stats);
+	free(par_results);
+
+	if (tlb_fd >= 0) {
+		dbg("dTLB load misses: %" PRIu64 ", %.3f per packet",
+			tlb_stop - tlb_start,
+			t.pkt_num ? (double)(tlb_stop - tlb_start) / t.pkt_num : 0.0);
+	}
+	else {
+		dbg("dTLB load misses: not available, %s", strerror(-tlb_fd));
+	}
+
+	if (plat_cfg.multi) {
+		uint64_t match_sum = 0;
+
+		for (i = 0; i < t.pkt_num; i++) {
+			match_sum += multi_nums[i];
+		}
+
+		dbg("Matches per packet: %.2f, at most %d",
+			t.pkt_num ? (double)match_sum / t.pkt_num : 0.0,
+			hs_multi_max(&result));
+
+		free(multi_matches);
+		free(multi_nums);
+	}
+
+	if (plat_cfg.numa) {
+		struct numa_replicas reps;
+
+		dbg("Searching from every CPU, %d NUMA nodes", numa_node_num());
+
+		if (numa_replicate(&reps, &result)) {
+			dbg("NUMA replicas fail");
+			exit(-1);
+		}
+
+		if (numa_bench(&plat_cfg, &t, &result, NULL) ||
+			numa_bench(&plat_cfg, &t, &result, &reps)) {
+			dbg("Searching fail");
+		}
+
+		numa_destroy(&reps);
+	}
+
+	if (plat_cfg.cache_bits >= 0) {
+		struct flow_cache fc;
+
+		dbg("Searching with flow cache");
+
+		if (fc_init(&fc, plat_cfg.cache_bits, plat_cfg.cache_policy)) {
+			dbg("Flow cache fail");
+			exit(-1);
+		}
+
+		for (i = 0; i < t.pkt_num; i++) {
+			t.pkts[i].found = -1;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+		if (fc_search(&t, &fc, &result)) {
+			dbg("Searching fail");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stoptime);
+		timediff = make_timediff(stoptime, starttime);
+		if (timediff == 0) {
+			timediff = 1;
+		}
+
+		for (i = 0; i < t.pkt_num; i++) {
+			if (t.pkts[i].found != t.pkts[i].match_rule) {
+				dbg("packet %d match %d, but should match %d",
+					   i, t.pkts[i].found, t.pkts[i].match_rule);
+			}
+		}
+
+		dbg("Cache hits: %" PRIu64 ", misses: %" PRIu64 ", hit rate: %.2f%%",
+			fc.hits, fc.misses, fc.hits * 100.0 / (fc.hits + fc.misses));
+		dbg("Time for searching: %" PRIu64 "(us)", timediff);
+		dbg("Searching speed: %lld(pps)",
+			   (t.pkt_num * 1000000ULL) / timediff);
+
+		fc_destroy(&fc);
+	}
+
+	if (plat_cfg.s_counter_file) {
+		if (counter_dump(&counter, plat_cfg.s_counter_file)) {
+			dbg("Cannot dump hit counters to %s", plat_cfg.s_counter_file);
+		}
+		else {
+			dbg("Hit counters dumped to %s", plat_cfg.s_counter_file);
+		}
+	}
+
+	counter_destroy(&counter);
+	prefilter_destroy(&pf);
+	dispatch_destroy(&disp);
+	hs_exact_destroy(&exact);
+	rank_destroy(&rank);
+	hs_jit_free(&jit);
+	hs_codegen_unload(&codegen);
 
 #if 0
 	uint32_t tnode = 0;
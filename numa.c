@@ -0,0 +1,191 @@
+/*
+ *     Filename: numa.c
+ *  Description: Source file for NUMA-local forest replicas
+ *
+ *         Note: Nodes are read from sysfs and memory is bound with raw
+ *               mbind(2), see hp_alloc_node(), so there is no libnuma
+ *               dependency. A search thread asks getcpu(2) for its node
+ *               and searches the replica of that node; pinned threads
+ *               keep asking the same node. Without NUMA support every
+ *               thread ends up on node 0 and its single replica.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "numa.h"
+#include "dbg.h"
+
+#define NUMA_ONLINE_FILE "/sys/devices/system/node/online"
+
+/* Nodes online as a bitmask, node 0 only if sysfs says nothing */
+static uint64_t numa_online(void)
+{
+	int lo, hi, n;
+	uint64_t mask = 0;
+	char buf[256], *p;
+	FILE *fp = fopen(NUMA_ONLINE_FILE, "r");
+
+	if (!fp) {
+		return 1;
+	}
+
+	if (!fgets(buf, sizeof(buf), fp)) {
+		fclose(fp);
+		return 1;
+	}
+
+	fclose(fp);
+
+	/* A list of ranges such as "0-1,3" */
+	for (p = buf; sscanf(p, "%d%n", &lo, &n) == 1; p++) {
+		hi = lo;
+		p += n;
+		if (*p == '-' && sscanf(p + 1, "%d%n", &hi, &n) == 1) {
+			p += n + 1;
+		}
+
+		for (; lo <= hi && lo < HP_NODE_MAX; lo++) {
+			mask |= 1ULL << lo;
+		}
+
+		if (*p != ',') {
+			break;
+		}
+	}
+
+	return mask ? mask : 1;
+}
+
+int numa_node_num(void)
+{
+	return 64 - __builtin_clzll(numa_online());
+}
+
+/* The node of the CPU the calling thread runs on */
+int numa_node_self(void)
+{
+	unsigned int cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) || node >= HP_NODE_MAX) {
+		return 0;
+	}
+
+	return node;
+}
+
+/* Run the calling thread on cpu only */
+int numa_pin_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		return -EINVAL;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set)) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void *numa_alloc_fn(size_t size, void *arg)
+{
+	int kind, node = (intptr_t)arg;
+	void *ptr = hp_alloc_node(size, node, &kind);
+
+	if (ptr) {
+		dbg("Replica on node %d: %zu Bytes on %s", node, size,
+			hp_kind_name(kind));
+	}
+
+	return ptr;
+}
+
+static void numa_free_fn(void *ptr, size_t size, void *arg)
+{
+	(void)arg;
+
+	hp_free(ptr, size);
+
+	return;
+}
+
+int numa_replicate(struct numa_replicas *reps, const void *built_result)
+{
+	int node, ret;
+	uint64_t online = numa_online();
+	struct hs_alloc alloc = {
+		.alloc	= numa_alloc_fn,
+		.free	= numa_free_fn
+	};
+
+	if (!reps || !built_result) {
+		return -EINVAL;
+	}
+
+	memset(reps, 0, sizeof(*reps));
+	reps->node_num = 64 - __builtin_clzll(online);
+
+	for (node = 0; node < reps->node_num; node++) {
+		if (!(online & 1ULL << node)) {
+			continue;
+		}
+
+		alloc.arg = (void *)(intptr_t)node;
+		ret = hs_clone(&reps->results[node], built_result, &alloc);
+		if (ret) {
+			numa_destroy(reps);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* The replica local to the calling thread, as a built_result */
+const void *numa_replica(const struct numa_replicas *reps)
+{
+	int node = numa_node_self();
+
+	if (!reps || !reps->node_num) {
+		return NULL;
+	}
+
+	/* A node without a replica takes the first one */
+	if (node >= reps->node_num || !reps->results[node]) {
+		for (node = 0; !reps->results[node]; node++);
+	}
+
+	return &reps->results[node];
+}
+
+void numa_destroy(struct numa_replicas *reps)
+{
+	int node;
+
+	if (!reps) {
+		return;
+	}
+
+	for (node = 0; node < reps->node_num; node++) {
+		hs_destroy(&reps->results[node]);
+		reps->results[node] = NULL;
+	}
+
+	reps->node_num = 0;
+
+	return;
+}
@@ -0,0 +1,31 @@
+/*
+ *     Filename: numa.h
+ *  Description: Header file for NUMA-local forest replicas
+ */
+
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include "hypersplit.h"
+#include "hugepage.h"
+
+/*
+ * One hs_clone() of the forest per online NUMA node, on huge pages bound
+ * to that node. results[node] is used as the built_result of the search
+ * functions, NULL for nodes that are not online.
+ */
+struct numa_replicas {
+	struct hs_result	*results[HP_NODE_MAX];
+	int					node_num; /* highest online node + 1 */
+};
+
+
+int numa_node_num(void);
+int numa_node_self(void);
+int numa_pin_cpu(int cpu);
+
+int numa_replicate(struct numa_replicas *reps, const void *built_result);
+const void *numa_replica(const struct numa_replicas *reps);
+void numa_destroy(struct numa_replicas *reps);
+
+#endif /* __NUMA_H__ */
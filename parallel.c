@@ -0,0 +1,224 @@
+/*
+ *     Filename: parallel.c
+ *  Description: Source file for the multi-threaded trace search
+ *
+ *         Note: The trace is cut into chunks of PAR_CHUNK_PKTS packets and
+ *               every pinned worker starts with an even share of them.
+ *               The share is one 64-bit word, the next chunk in the low
+ *               half and the end in the high half: the owner takes chunks
+ *               from the front, an idle worker steals the back half, both
+ *               with a compare and swap. A chunk is searched in a copy on
+ *               the stack of the worker, and only the results go back to
+ *               the shared results array, whole cache lines per chunk, so
+ *               no two workers ever write the same cache line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parallel.h"
+#include "numa.h"
+#include "utils.h"
+#include "dbg.h"
+
+struct par_worker {
+	uint64_t			range; /* end << 32 | next chunk, see par_take() */
+	int					id;
+	int					thread_num;
+	int					ret;
+	pthread_t			tid;
+	struct par_worker	*workers;
+	const struct trace	*trace;
+	int					*results;
+	par_search_t		search;
+	void				*arg;
+	pthread_barrier_t	*barrier;
+	struct par_stats	stats;
+} __attribute__((aligned(64)));
+
+static inline uint64_t par_range(uint32_t next, uint32_t end)
+{
+	return (uint64_t)end << 32 | next;
+}
+
+/* The next chunk of w's own share, or -1 if it is empty */
+static int par_take(struct par_worker *w)
+{
+	uint32_t next, end;
+	uint64_t old = __atomic_load_n(&w->range, __ATOMIC_ACQUIRE);
+
+	do {
+		next = old;
+		end = old >> 32;
+		if (next >= end) {
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&w->range, &old,
+										  par_range(next + 1, end), 1,
+										  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return next;
+}
+
+/* Move the back half of victim's share to the empty share of thief */
+static int par_steal(struct par_worker *thief, struct par_worker *victim)
+{
+	uint32_t next, end, mid;
+	uint64_t old = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+
+	do {
+		next = old;
+		end = old >> 32;
+		if (next >= end) {
+			return 0;
+		}
+
+		mid = end - (end - next + 1) / 2;
+	} while (!__atomic_compare_exchange_n(&victim->range, &old,
+										  par_range(next, mid), 1,
+										  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	/* Nobody takes from or steals an empty share, a plain store is enough */
+	__atomic_store_n(&thief->range, par_range(mid, end), __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+static uint64_t par_timediff(const struct timespec *stop,
+							 const struct timespec *start)
+{
+	return (stop->tv_sec - start->tv_sec) * 1000000ULL +
+		   stop->tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+static void *par_worker_run(void *arg)
+{
+	int i, k, chunk, pkt_num;
+	struct par_worker *w = arg, *victim;
+	struct packet pkts[PAR_CHUNK_PKTS];
+	struct trace t = { .pkts = pkts };
+	struct timespec starttime, stoptime;
+
+	numa_pin_cpu(w->stats.cpu);
+
+	pthread_barrier_wait(w->barrier);
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+	for (;;) {
+		chunk = par_take(w);
+
+		/* Own share done, look for a victim with chunks left */
+		for (i = 1; chunk < 0 && i < w->thread_num; i++) {
+			victim = &w->workers[(w->id + i) % w->thread_num];
+			if (par_steal(w, victim)) {
+				w->stats.steal_num++;
+				chunk = par_take(w);
+			}
+		}
+
+		if (chunk < 0) {
+			break;
+		}
+
+		k = chunk * PAR_CHUNK_PKTS;
+		pkt_num = MIN(PAR_CHUNK_PKTS, w->trace->pkt_num - k);
+
+		memcpy(pkts, &w->trace->pkts[k], pkt_num * sizeof(*pkts));
+		t.pkt_num = pkt_num;
+
+		if (w->search(&t, w->id, w->arg)) {
+			w->ret = -EINVAL;
+		}
+
+		for (i = 0; i < pkt_num; i++) {
+			w->results[k + i] = pkts[i].found;
+		}
+
+		w->stats.chunk_num++;
+		w->stats.pkt_num += pkt_num;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &stoptime);
+	w->stats.timediff = par_timediff(&stoptime, &starttime);
+
+	return NULL;
+}
+
+/*
+ * Search trace with thread_num workers pinned to CPUs round robin, and put
+ * the result of packet i in results[i]. results must be cache line aligned
+ * so that chunks of different workers do not share a line. stats, if not
+ * NULL, gets thread_num entries.
+ */
+int par_search(const struct trace *trace, int *results, int thread_num,
+			   par_search_t search, void *arg, struct par_stats *stats)
+{
+	int i, ret = 0, cpu_num, chunk_num;
+	struct par_worker *workers;
+	pthread_barrier_t barrier;
+
+	if (!trace || !trace->pkts || !results || !search ||
+		thread_num <= 0 || thread_num > PAR_THREAD_MAX) {
+		return -EINVAL;
+	}
+
+	if (posix_memalign((void **)&workers, sizeof(*workers),
+					   thread_num * sizeof(*workers))) {
+		return -ENOMEM;
+	}
+
+	memset(workers, 0, thread_num * sizeof(*workers));
+
+	cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_num <= 0) {
+		cpu_num = 1;
+	}
+
+	chunk_num = (trace->pkt_num + PAR_CHUNK_PKTS - 1) / PAR_CHUNK_PKTS;
+	pthread_barrier_init(&barrier, NULL, thread_num);
+
+	for (i = 0; i < thread_num; i++) {
+		workers[i].range = par_range((uint64_t)chunk_num * i / thread_num,
+									 (uint64_t)chunk_num * (i + 1) /
+									 thread_num);
+		workers[i].id = i;
+		workers[i].thread_num = thread_num;
+		workers[i].workers = workers;
+		workers[i].trace = trace;
+		workers[i].results = results;
+		workers[i].search = search;
+		workers[i].arg = arg;
+		workers[i].barrier = &barrier;
+		workers[i].stats.cpu = i % cpu_num;
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		if (pthread_create(&workers[i].tid, NULL, par_worker_run,
+						   &workers[i])) {
+			dbg("Cannot start worker %d", i);
+			exit(-1);
+		}
+	}
+
+	for (i = 0; i < thread_num; i++) {
+		pthread_join(workers[i].tid, NULL);
+
+		if (workers[i].ret) {
+			ret = workers[i].ret;
+		}
+
+		if (stats) {
+			stats[i] = workers[i].stats;
+		}
+	}
+
+	pthread_barrier_destroy(&barrier);
+	free(workers);
+
+	return ret;
+}
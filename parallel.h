@@ -0,0 +1,31 @@
+/*
+ *     Filename: parallel.h
+ *  Description: Header file for the multi-threaded trace search
+ */
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <stdint.h>
+#include "rule_trace.h"
+
+/* packets per chunk, a whole number of cache lines of results */
+#define PAR_CHUNK_PKTS 256
+#define PAR_THREAD_MAX 256
+
+/* Search the packets of chunk on behalf of worker, 0 on success */
+typedef int (*par_search_t)(const struct trace *chunk, int worker, void *arg);
+
+struct par_stats {
+	int			cpu;
+	int			chunk_num;
+	int			steal_num; /* successful steals from other workers */
+	uint64_t	pkt_num;
+	uint64_t	timediff; /* us searching, from the common start */
+};
+
+
+int par_search(const struct trace *trace, int *results, int thread_num,
+			   par_search_t search, void *arg, struct par_stats *stats);
+
+#endif /* __PARALLEL_H__ */
@@ -0,0 +1,200 @@
+/*
+ *     Filename: rank.c
+ *  Description: Source file for rank space coordinate compression
+ *
+ *         Note: The elementary intervals of every dimension come from
+ *               shadow_rules() over the whole rule set. A rule [lo, hi]
+ *               becomes [rank(lo), rank(hi)], except that a rule reaching
+ *               the end of the domain keeps the domain maximum, so the
+ *               default rule still covers the space hs_trigger() starts
+ *               from. A packet value v matches [lo, hi] if and only if
+ *               rank(v) matches the ranked rule, so trees built and
+ *               searched in rank space return the same results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "rank.h"
+#include "dbg.h"
+
+static const uint32_t rank_dim_max[DIM_MAX] = {
+	UINT32_MAX, UINT32_MAX,
+	UINT16_MAX, UINT16_MAX,
+	UINT8_MAX,
+#ifdef ENABLE_NIC
+	UINT32_MAX
+#endif
+};
+
+static int rank_dim_build(struct rank_map *map, const struct rule_set *p_rs,
+						  int dim)
+{
+	int i, ret, *rule_id;
+	int64_t *spnts;
+	uint32_t *bnds, value;
+	struct shadow_range srng;
+	const uint32_t dim_rng[2] = { 0, rank_dim_max[dim] };
+
+	rule_id = malloc(p_rs->rule_num * sizeof(*rule_id));
+	spnts = malloc((p_rs->rule_num << 1) * sizeof(*spnts));
+	srng.pnts = malloc((p_rs->rule_num << 2) * sizeof(*srng.pnts));
+	srng.cnts = NULL;
+	if (!rule_id || !spnts || !srng.pnts) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < p_rs->rule_num; i++) {
+		rule_id[i] = i;
+	}
+
+	ret = shadow_rules(&srng, spnts, dim_rng, rule_id, p_rs->rule_num,
+					   p_rs->rules, dim);
+	if (ret) {
+		goto out;
+	}
+
+	/* The default rule covers the domain: the intervals are contiguous */
+	if (!srng.point_num || srng.pnts[0] != 0) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	bnds = malloc((srng.point_num >> 1) * sizeof(*bnds));
+	if (!bnds) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < srng.point_num >> 1; i++) {
+		bnds[i] = srng.pnts[i << 1];
+	}
+
+	map->bnds[dim] = bnds;
+	map->bnd_num[dim] = srng.point_num >> 1;
+
+	if (rank_dim_max[dim] <= UINT16_MAX) {
+		map->table[dim] = malloc((rank_dim_max[dim] + 1) *
+								 sizeof(*map->table[dim]));
+		if (!map->table[dim]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		for (value = 0; value <= rank_dim_max[dim]; value++) {
+			map->table[dim][value] = rank_bsearch(bnds, map->bnd_num[dim],
+												  value);
+		}
+
+		map->table_max[dim] = rank_dim_max[dim];
+	}
+
+out:
+	free(srng.pnts);
+	free(spnts);
+	free(rule_id);
+
+	return ret;
+}
+
+int rank_build(struct rank_map *map, const struct partition *part)
+{
+	int dim, ret;
+	struct rule_set rs;
+
+	if (!map || !part || !part->subsets) {
+		return -EINVAL;
+	}
+
+	memset(map, 0, sizeof(*map));
+
+	ret = revert_partition(&rs, part);
+	if (ret) {
+		return ret;
+	}
+
+	for (dim = 0; dim < DIM_MAX; dim++) {
+		ret = rank_dim_build(map, &rs, dim);
+		if (ret) {
+			rank_destroy(map);
+			break;
+		}
+
+		dbg("Rank space: dim %d, %d ranks", dim, map->bnd_num[dim]);
+	}
+
+	free(rs.rules);
+
+	return ret;
+}
+
+int rank_rules(const struct rank_map *map, struct partition *part)
+{
+	int i, j, dim;
+	uint32_t *rng;
+	const struct rule_set *p_rs;
+
+	if (!map || !part || !part->subsets) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < part->subset_num; i++) {
+		p_rs = &part->subsets[i];
+
+		for (j = 0; j < p_rs->rule_num; j++) {
+			for (dim = 0; dim < DIM_MAX; dim++) {
+				rng = p_rs->rules[j].dims[dim];
+
+				if (rng[1] != rank_dim_max[dim]) {
+					rng[1] = rank_lookup(map, dim, rng[1]);
+				}
+
+				rng[0] = rank_lookup(map, dim, rng[0]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+int rank_trace(const struct rank_map *map, const struct trace *trace)
+{
+	int i, dim;
+	struct packet *p_pkt;
+
+	if (!map || !trace || !trace->pkts) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < trace->pkt_num; i++) {
+		p_pkt = &trace->pkts[i];
+
+		for (dim = 0; dim < DIM_MAX; dim++) {
+			p_pkt->dims[dim] = rank_lookup(map, dim, p_pkt->dims[dim]);
+		}
+	}
+
+	return 0;
+}
+
+void rank_destroy(struct rank_map *map)
+{
+	int dim;
+
+	if (!map) {
+		return;
+	}
+
+	for (dim = 0; dim < DIM_MAX; dim++) {
+		free(map->table[dim]);
+		free(map->bnds[dim]);
+		map->table[dim] = NULL;
+		map->bnds[dim] = NULL;
+		map->bnd_num[dim] = 0;
+	}
+
+	return;
+}
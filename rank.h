@@ -0,0 +1,57 @@
+/*
+ *     Filename: rank.h
+ *  Description: Header file for rank space coordinate compression
+ */
+
+#ifndef __RANK_H__
+#define __RANK_H__
+
+#include <stdint.h>
+#include "rule_trace.h"
+
+/*
+ * Every field is mapped to the index of its elementary interval, the
+ * rank. Ports and proto use direct tables, the other fields a binary
+ * search over the sorted interval starts.
+ */
+struct rank_map {
+	uint32_t	*bnds[DIM_MAX]; /* interval starts, bnds[d][0] == 0 */
+	int			bnd_num[DIM_MAX];
+	uint16_t	*table[DIM_MAX]; /* NULL for searched dimensions */
+	uint32_t	table_max[DIM_MAX];
+};
+
+/* Largest k with bnds[k] <= value, without branches */
+static inline uint32_t rank_bsearch(const uint32_t *bnds, int bnd_num,
+									uint32_t value)
+{
+	int half;
+	const uint32_t *base = bnds;
+
+	while (bnd_num > 1) {
+		half = bnd_num >> 1;
+		base = base[half] <= value ? base + half : base;
+		bnd_num -= half;
+	}
+
+	return base - bnds;
+}
+
+static inline uint32_t rank_lookup(const struct rank_map *map, int dim,
+								   uint32_t value)
+{
+	if (map->table[dim]) {
+		value = value < map->table_max[dim] ? value : map->table_max[dim];
+		return map->table[dim][value];
+	}
+
+	return rank_bsearch(map->bnds[dim], map->bnd_num[dim], value);
+}
+
+
+int rank_build(struct rank_map *map, const struct partition *part);
+int rank_rules(const struct rank_map *map, struct partition *part);
+int rank_trace(const struct rank_map *map, const struct trace *trace);
+void rank_destroy(struct rank_map *map);
+
+#endif /* __RANK_H__ */
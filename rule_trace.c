@@ -343,6 +343,12 @@ int load_partition(struct partition *p_pa, const char *s_pf)
 				ret = -ENOTSUP;
 				goto err;
 			}
+
+#ifdef ENABLE_NIC
+			/* Partition files carry no NIC, the rules take any */
+			rules[i].dims[DIM_NIC][0] = 0;
+			rules[i].dims[DIM_NIC][1] = UINT32_MAX;
+#endif
 		}
 
 		subsets[part_idx].rules = rules;